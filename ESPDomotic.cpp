@@ -7,10 +7,97 @@
 #ifndef ESP01
 #include <ESP8266mDNS.h>
 #endif
+
+/* Module log calls. Kept out of the header so they do not clash with the sketch or other libs macros. */
+#if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_ERROR
+#define LOG_ERROR(...)  logMessage(DOMOTIC_LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)
+#endif
+#if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_WARN
+#define LOG_WARN(...)   logMessage(DOMOTIC_LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)
+#endif
+#if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_INFO
+#define LOG_INFO(...)   logMessage(DOMOTIC_LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)
+#endif
+#if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...)  logMessage(DOMOTIC_LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)
+#endif
+
 #ifdef USE_JSON
 #include <ArduinoJson.h>
+
+/*
+  Channels settings document capacity: 4 members per channel, plus the strings copied into it (the "<id>_x" keys and
+  the name). Longer ids may not fit, wich overflowed() tells.
+*/
+const uint8_t   _jsonChannelIdMaxLength = 8;
+const size_t    _settingsJsonCapacity   = JSON_OBJECT_SIZE(MAX_CHANNELS * 4)
+    + MAX_CHANNELS * (4 * (_jsonChannelIdMaxLength + 3) + _channelNameMaxLength + 1);
 #endif
 
+/*
+  Log structured key-value store kept in a single file, backing updateConf/getConf.
+  Writes are appended as [key length][value length][key][value] records and an in RAM index maps each key
+  to its latest record, so a read is a hash lookup plus one file read. The space taken by overwritten
+  records is reclaimed by compacting the file from loop() once it goes over a threshold.
+*/
+#ifndef MAX_CONF_KEYS
+#define MAX_CONF_KEYS 16
+#endif
+const uint8_t   _confKeyMaxLength       = 31;
+const uint16_t  _confCompactThreshold   = 512;  // garbage bytes tolerated before compacting
+const uint8_t   _confRecordHeaderLength = 3;
+const uint8_t   _confIndexSize          = MAX_CONF_KEYS * 2;  // half empty keeps probe sequences short
+
+class ConfStore {
+  public:
+    // Builds the index scanning the store file. The file system must be mounted.
+    void        begin(const char* fileName);
+    bool        isReady();
+    // Reads the value into buff, up to size bytes. Returns the value length, -1 if none
+    int         get(const char* key, char* buff, size_t size);
+    // Returns a copy (null terminated, to be deleted) of the value stored under the key. Null if none or empty.
+    char*       copy(const char* key);
+    bool        put(const char* key, const char* value, size_t length);
+    // Tells if enough overwritten records piled up (or a torn write was found) to rewrite the file
+    bool        needsCompaction();
+    bool        compact();
+
+  private:
+    struct Entry {
+      uint16_t  hash;     // 0 means empty slot
+      uint16_t  offset;
+      uint16_t  length;
+      uint8_t   keyLength;
+    };
+
+    const char* _fileName   = NULL;
+    Entry       _index[_confIndexSize];
+    uint8_t     _count      = 0;
+    uint32_t    _size       = 0;      // bytes taken by complete records
+    uint32_t    _garbage    = 0;      // bytes taken by overwritten records
+    bool        _torn       = false;  // a partially written record was found at the end of the file
+
+    static uint16_t hashKey(const char* key, size_t length);
+    Entry*      find(File& file, const char* key, size_t keyLength, uint16_t hash);
+    // Takes a free slot for a new key. The index must not be full.
+    Entry*      insert(uint16_t hash, uint8_t keyLength);
+    bool        index(File& file, const char* key, uint8_t keyLength, uint16_t offset, uint16_t length);
+};
+
+ConfStore                 _confStore;
+/* A failed compaction (e.g. flash full) is retried with a growing wait, so the loop is not spent on it */
+const uint16_t            _confCompactRetryMillis = 1000;
+unsigned long             _confCompactAt        = 0;
+uint8_t                   _confCompactFailures  = 0;
+
 /* Config params */
 #ifndef MQTT_OFF
 ESPConfigParam            _mqttPort (Text, "mqttPort", "MQTT port", "", _paramPortValueLength, "required");
@@ -28,30 +115,226 @@ WiFiClient                _wifiClient;
 #ifndef MQTT_OFF
 /* MQTT client */
 PubSubClient              _mqttClient(_wifiClient);
+PubSubTransport           _pubSubTransport(_mqttClient);
+/* Transport the module messages go through */
+MessageTransport*         _transport            = &_pubSubTransport;
 /* MQTT broker reconnection control */
 unsigned long             _mqttNextConnAtte     = 0;
 unsigned int              _mqttReconnections    = 0;
-#endif 
+bool                      _mqttPersistentSession = false;
+bool                      _mqttCollapsedSubscriptions = false;
+unsigned long             _mqttConnectMillis    = 0;
+/* Feedback waiting for the broker to be reachable */
+FeedbackQueue             _pendingFeedback;
+/* MQTT incoming messages dispatching */
+TopicDispatcher           _topicDispatcher;
+char                      _topicPrefix[_topicPrefixMaxLength];
+size_t                    _topicPrefixLength    = 0;
+char                      _receivedTopic[MQTT_MAX_PACKET_SIZE];
+#endif
+
+#ifndef MQTT_OFF
+/*
+Prints into a fixed buffer, so messages are built without allocations. What does not fit is dropped but still
+counted, so a null buffer just measures the text.
+*/
+class BufferPrint : public Print {
+  public:
+    BufferPrint(char* buff, size_t size) : _buff(buff), _size(size) {}
+
+    // Bytes printed, including those that did not fit
+    size_t  length = 0;
+
+    size_t write(uint8_t c) override {
+      if (length < _size) {
+        _buff[length] = c;
+      }
+      ++length;
+      return 1;
+    }
+
+    // Bytes kept in the buffer
+    size_t  kept() {
+      return length < _size ? length : _size;
+    }
+
+  private:
+    char*   _buff;
+    size_t  _size;
+};
+
+// Snapshot entries are built one channel at a time into a buffer of this size
+const uint8_t             _snapshotEntryMaxLength = 128;
+
+// Prints the text escaped as a json string content
+static void printJsonText(Print& out, const char* text) {
+  static const char hex[] = "0123456789abcdef";
+  for (; *text; ++text) {
+    uint8_t c = *text;
+    if (c < 0x20) {
+      // Control chars are not allowed raw in json strings
+      out.print(F("\\u00"));
+      out.write(hex[c >> 4]);
+      out.write(hex[c & 0x0F]);
+      continue;
+    }
+    if (c == '"' || c == '\\') {
+      out.write('\\');
+    }
+    out.write(c);
+  }
+}
+#endif
+
+#ifdef LOGGING
+/* Log lines level code, indexed by level */
+const char                _logLevelCodes[]      = "-EWID";
+#endif
+
+#ifdef MQTT_LOG
+/* Log lines waiting to be published */
+LogRing                   _logRing;
+unsigned long             _logDrainAt           = 0;
+const uint8_t             _logLineMaxLength     = 128;
+#endif
+
+#ifdef METRICS
+RuntimeMetrics            _metrics;
+unsigned long             _metricsPublishAt     = 0;
+bool                      _mqttConnectedOnce    = false;
+#endif
 
 char                      _stationName[_paramValueMaxLength * 3 + 4];
 
-bool            _runningStandAlone    = false;
+/* File system. Mounted once, files sizes & existence cached */
+struct FileCacheEntry {
+  char          name[_fileNameMaxLength];
+  size_t        size;
+  bool          exists;
+};
+const uint8_t   _fileCacheSize        = 4;
+bool            _fsMounted            = false;
+FileCacheEntry  _fileCache[_fileCacheSize];
+uint8_t         _fileCacheNext        = 0;
+
+bool            _runningStandAlone    = true;
+unsigned long   _outputsReadyMillis   = 0;
 uint8_t         _channelsCount        = 0;
 
+/* Channels timers scheduling */
+// Bit i is set while channel i has a running timer
+uint32_t        _armedTimers          = 0;
+unsigned long   _nextTimerDeadline    = 0;
+
+/* Wifi connectivity */
+ConnectivityState _connectivityState      = CONNECTIVITY_STANDALONE;
+unsigned long     _connectivityStateSince = 0;
+bool              _configPortalAllowed    = true;
+bool              _networkServicesStarted = false;
+std::function<void(ConnectivityState)> _connectivityCallback;
+/* Non blocking feedback */
+unsigned long   _feedbackNextToggle   = 0;
+uint16_t        _feedbackPeriod       = 0;
+uint8_t         _feedbackToggles      = 0;
+
 uint16_t        _wifiConnectTimeout   = 30;
+uint16_t        _wifiRetryInterval    = 60;
 uint16_t        _configPortalTimeout  = 60;
 uint16_t        _configFileSize       = 200;
 
+/* Input channels. Pins edges are queued from the interrupts and taken from the loop once the pin is stable. */
+InputEventQueue _inputEvents;
+uint32_t        _inputChannels        = 0;
+// Inputs on pins without interrupt (GPIO16), read on each loop
+uint32_t        _polledInputs         = 0;
+// Inputs waiting for their pin to be stable
+uint32_t        _pendingInputs        = 0;
+unsigned long   _inputSettleAt[MAX_CHANNELS];
+uint8_t         _inputLastRead[MAX_CHANNELS];
+
+static void IRAM_ATTR onInputChange(void* channel) {
+  _inputEvents.push((uint8_t) (uintptr_t) channel, millis());
+}
+
+/* Channels settings persistence */
+bool            _persistChannelsState = false;
+bool            _settingsDirty        = false;
+unsigned long   _settingsSaveAt       = 0;
+uint16_t        _settingsCommitDelay  = 3000;
+
 ESPDomotic::ESPDomotic() {
 }
 
 ESPDomotic::~ESPDomotic() {}
 
 void ESPDomotic::init() {
-  #ifdef LOGGING
-  debug(F("ESP Domotic module INIT"));
+  LOG_INFO(F("ESP Domotic module INIT"));
+  /* Fast boot. Channels pins are driven before bringing wifi up, wich may take up to the connect timeout */
+  mountFS();
+  _confStore.begin("/conf.kv");
+  loadChannelsSettings();
+  initChannelsPins();
+  _outputsReadyMillis = millis();
+  LOG_INFO(F("Channels pins ready (millis)"), _outputsReadyMillis);
+  if (_feedbackPin != _invalidPinNo) {
+    pinMode(_feedbackPin, OUTPUT);
+  }
+  #ifndef MQTT_OFF
+  _transport->setCallback(std::bind(&ESPDomotic::receiveMqttMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
   #endif
-  /* Wifi connection */
+  /* Wifi connection. It is brought up from loop(), so channels keep working meanwhile */
+  if (loadConfig()) {
+    beginWifiConnection();
+  } else {
+    // Nothing to connect to until the user configures the module
+    runConfigPortal();
+  }
+}
+
+void ESPDomotic::initChannelsPins() {
+  LOG_DEBUG(F("Setting channels pin mode. Channels count"), _channelsCount);
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    #if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
+    Serial.printf_P(PSTR("Setting pin %d of channel %s to %s mode\n"), _channels[i]->pin, _channels[i]->name, _channels[i]->pinMode == OUTPUT ? "OUTPUT" : "INPUT");
+    #endif
+    pinMode(_channels[i]->pin, _channels[i]->pinMode);
+    if (_channels[i]->pinMode == OUTPUT) {
+      digitalWrite(_channels[i]->pin, _channels[i]->state);
+      if (_persistChannelsState && _channels[i]->state == LOW) {
+        // The channel was on when the module went down, so its timer starts over
+        _channels[i]->locallyChanged = true;
+        _channels[i]->updateTimerControl();
+      }
+    } else {
+      _channels[i]->state = digitalRead(_channels[i]->pin);
+      _inputLastRead[i] = _channels[i]->state;
+      _inputChannels |= 1UL << i;
+      int interrupt = digitalPinToInterrupt(_channels[i]->pin);
+      if (interrupt == NOT_AN_INTERRUPT) {
+        _polledInputs |= 1UL << i;
+      } else {
+        attachInterruptArg(interrupt, onInputChange, (void*) (uintptr_t) i, CHANGE);
+      }
+    }
+  }
+  scheduleChannelsTimers();
+}
+
+/*
+  Connects to the stored network straight through the wifi stack, so loop() keeps running meanwhile. The minimum
+  signal quality is applied by the portal when listing the networks to pick, the stored one is joined whatever it is.
+*/
+void ESPDomotic::beginWifiConnection() {
+  LOG_INFO(F("Connecting to wifi"));
+  WiFi.mode(WIFI_STA);
+  WiFi.begin();
+  setConnectivityState(CONNECTIVITY_CONNECTING);
+}
+
+void ESPDomotic::runConfigPortal() {
+  // The portal is served by ESPConfig and blocks until configured or timed out
+  setConnectivityState(CONNECTIVITY_PORTAL);
+  _configPortalAllowed = false;
   ESPConfig* _moduleConfig = new ESPConfig;
   _moduleConfig->addParameter(&_moduleLocation);
   _moduleConfig->addParameter(&_moduleName);
@@ -72,127 +355,311 @@ void ESPDomotic::init() {
   _moduleConfig->setStationNameCallback(std::bind(&ESPDomotic::getStationName, this));
   _moduleConfig->setSaveConfigCallback(std::bind(&ESPDomotic::saveConfig, this));
   if (_feedbackPin != _invalidPinNo) {
-    pinMode(_feedbackPin, OUTPUT);
     _moduleConfig->setFeedbackPin(_feedbackPin);
   }
-  _runningStandAlone = !_moduleConfig->connectWifiNetwork(loadConfig());
-  #ifdef LOGGING
-  debug(F("Connected to wifi"), _runningStandAlone ? "false" : "true");
-  #endif
-  if (_feedbackPin != _invalidPinNo) {
-    if (_runningStandAlone) {
-      // could not connect to a wifi net
-      _moduleConfig->blockingFeedback(_feedbackPin, 2000, 1);
-    } else {
-      // connected to a wifi net and able to send/receive mqtt messages
-      _moduleConfig->blockingFeedback(_feedbackPin, 100, 10);
-    }
-  }
+  bool connected = _moduleConfig->connectWifiNetwork(false);
   delete _moduleConfig;
-  #ifdef LOGGING
-  debug(F("Setting channels pin mode. Channels count"), _channelsCount);
+  setConnectivityState(connected ? CONNECTIVITY_CONNECTED : CONNECTIVITY_STANDALONE);
+}
+
+void ESPDomotic::tickConnectivity() {
+  unsigned long elapsed = millis() - _connectivityStateSince;
+  switch (_connectivityState) {
+    case CONNECTIVITY_CONNECTING:
+      if (WiFi.status() == WL_CONNECTED) {
+        setConnectivityState(CONNECTIVITY_CONNECTED);
+      } else if (elapsed >= _wifiConnectTimeout * 1000UL) {
+        LOG_WARN(F("Wifi connection timed out"));
+        if (_configPortalAllowed) {
+          runConfigPortal();
+        } else {
+          setConnectivityState(CONNECTIVITY_STANDALONE);
+        }
+      }
+      break;
+    case CONNECTIVITY_CONNECTED:
+      if (WiFi.status() != WL_CONNECTED) {
+        // The wifi stack reconnects on its own, just wait for it
+        setConnectivityState(CONNECTIVITY_CONNECTING);
+      }
+      break;
+    case CONNECTIVITY_STANDALONE:
+      if (elapsed >= _wifiRetryInterval * 1000UL) {
+        beginWifiConnection();
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void ESPDomotic::setConnectivityState(ConnectivityState state) {
+  _connectivityState = state;
+  _connectivityStateSince = millis();
+  _runningStandAlone = state != CONNECTIVITY_CONNECTED;
+  if (state == CONNECTIVITY_CONNECTED) {
+    LOG_INFO(F("Connected to wifi"));
+    // The portal is offered just on boot, a wifi outage later on must not block the module
+    _configPortalAllowed = false;
+    startNetworkServices();
+    // connected to a wifi net and able to send/receive mqtt messages
+    startFeedback(100, 10);
+  } else if (state == CONNECTIVITY_CONNECTING) {
+    // connecting to the wifi net, as the ESPConfig connect feedback does
+    startFeedback(250, 1);
+  } else if (state == CONNECTIVITY_STANDALONE) {
+    LOG_WARN(F("Running stand alone. Retrying wifi connection in (seconds)"), _wifiRetryInterval);
+    // could not connect to a wifi net
+    startFeedback(2000, 1);
+  }
+  if (_connectivityCallback) {
+    _connectivityCallback(state);
+  }
+}
+
+void ESPDomotic::startNetworkServices() {
+  if (_networkServicesStarted) {
+    return;
+  }
+  _networkServicesStarted = true;
+  #ifndef MQTT_OFF
+  // Config params are loaded (or set through the portal) at this point, so topics wont change anymore
+  buildTopicPrefix();
+  LOG_INFO(F("Configuring MQTT broker"));
+  LOG_INFO(F("HOST"), getMqttServerHost());
+  LOG_INFO(F("PORT"), getMqttServerPort());
+  _mqttClient.setServer(getMqttServerHost(), getMqttServerPort());
+  // Keep a broker that does not answer from freezing the loop for the default socket timeouts
+  _wifiClient.setTimeout(_mqtt_connect_timeout_millis);
+  _mqttClient.setSocketTimeout(_mqtt_connect_timeout_millis < 1000 ? 1 : _mqtt_connect_timeout_millis / 1000);
   #endif
-  for (int i = 0; i < _channelsCount; ++i) {
-    #ifdef LOGGING
-    Serial.printf("Setting pin %d of channel %s to %s mode\n", _channels[i]->pin, _channels[i]->name, _channels[i]->pinMode == OUTPUT ? "OUTPUT" : "INPUT");
-    #endif
-    pinMode(_channels[i]->pin, _channels[i]->pinMode);
-    if (_channels[i]->pinMode == OUTPUT) {
-      digitalWrite(_channels[i]->pin, _channels[i]->state);
-    } else {
-      _channels[i]->state = digitalRead(_channels[i]->pin);
-    }
+  // OTA Update
+  LOG_DEBUG(F("Setting OTA update"));
+  #ifndef ESP01
+  MDNS.begin(getStationName());
+  MDNS.addService("http", "tcp", 80);
+  #endif
+  _httpUpdater.setup(&_httpServer);
+  _httpServer.begin();
+  LOG_INFO(F("HTTPUpdateServer ready at IP"), WiFi.localIP());
+  #ifndef ESP01
+  LOG_INFO(F("HTTPUpdateServer ready at host (.local)"), getStationName());
+  #endif
+}
+
+void ESPDomotic::startFeedback(uint16_t period, uint8_t times) {
+  if (_feedbackPin == _invalidPinNo) {
+    return;
   }
-  if (!_runningStandAlone) {
-    #ifndef MQTT_OFF
-    #ifdef LOGGING
-    debug(F("Configuring MQTT broker"));
-    debug(F("HOST"), getMqttServerHost());
-    debug(F("PORT"), getMqttServerPort());
-    #endif
-    _mqttClient.setServer(getMqttServerHost(), getMqttServerPort());
-    _mqttClient.setCallback(std::bind(&ESPDomotic::receiveMqttMessage, this, std::placeholders::_1, std::placeholders::_2, std::placeholders::_3));
-    #endif
-    loadChannelsSettings();
-    // OTA Update
-    #ifdef LOGGING
-    debug(F("Setting OTA update"));
-    #endif
-    // no network connection so module cant be reached
-    #ifndef ESP01
-    MDNS.begin(getStationName());
-    MDNS.addService("http", "tcp", 80);
-    #endif
-    _httpUpdater.setup(&_httpServer);
-    _httpServer.begin();
-    #ifdef LOGGING
-    debug(F("HTTPUpdateServer ready.")); 
-    debug("Open http://" + WiFi.localIP().toString() + "/update");
-    #ifndef ESP01
-    debug("Open http://" + String(getStationName()) + ".local/update");
-    #endif
-    #endif
+  _feedbackPeriod = period;
+  _feedbackToggles = times * 2;
+  _feedbackNextToggle = millis();
+}
+
+void ESPDomotic::tickFeedback() {
+  if (_feedbackToggles > 0 && deadlineReached(millis(), _feedbackNextToggle)) {
+    --_feedbackToggles;
+    // Odd toggles turn the feedback on, so it always ends off
+    digitalWrite(_feedbackPin, _feedbackToggles % 2 ? HIGH : LOW);
+    _feedbackNextToggle += _feedbackPeriod;
+    if (_feedbackToggles == 0 && _connectivityState == CONNECTIVITY_CONNECTING) {
+      // Keeps blinking until the connection is settled
+      _feedbackToggles = 2;
+    }
   }
 }
 
 void ESPDomotic::loop() {
+  #ifdef METRICS
+  uint32_t loopStart = micros();
+  #endif
+  tickConnectivity();
+  tickFeedback();
   if (!_runningStandAlone) {
     _httpServer.handleClient();
-    #ifndef MQTT_OFF
-    if (!_mqttClient.loop()) {
+  }
+  #ifndef MQTT_OFF
+  // A transport with no network (e.g. the loopback) keeps running while standalone
+  if (!_runningStandAlone || !_transport->needsNetwork()) {
+    if (!_transport->loop()) {
       connectBroker();
     }
+    #ifdef MQTT_LOG
+    drainLog();
     #endif
   }
-  checkChannelsTimers();
+  #endif
+  if (_inputChannels) {
+    tickInputs();
+  }
+  if (_armedTimers && deadlineReached(millis(), _nextTimerDeadline)) {
+    checkChannelsTimers();
+  }
+  if (_settingsDirty && deadlineReached(millis(), _settingsSaveAt)) {
+    saveChannelsSettings();
+  }
+  if (_confStore.needsCompaction() && deadlineReached(millis(), _confCompactAt)) {
+    if (_confStore.compact()) {
+      _confCompactFailures = 0;
+    } else {
+      unsigned long wait = (unsigned long) _confCompactRetryMillis << (_confCompactFailures < 6 ? _confCompactFailures++ : 6);
+      LOG_WARN(F("Conf store compaction failed, retrying in (millis)"), wait);
+      _confCompactAt = millis() + wait;
+    }
+  }
+  #ifdef METRICS
+  _metrics.recordLoop(micros() - loopStart);
+  if (deadlineReached(millis(), _metricsPublishAt)) {
+    publishMetrics();
+  }
+  #endif
 }
 
 #ifndef MQTT_OFF
 void ESPDomotic::connectBroker() {
-  if (_mqttNextConnAtte <= millis() && _mqttReconnections++ < _mqtt_reconnection_max_retries) {
+  if (!deadlineReached(millis(), _mqttNextConnAtte)) {
+    return;
+  }
+  LOG_INFO(F("Connecting MQTT broker as"), getStationName());
+  unsigned long connectStart = millis();
+  // The broker tells the module is gone (last will) when the connection drops without a disconnect
+  char availabilityTopic[_topicMaxLength];
+  getStationTopic("availability", availabilityTopic, sizeof(availabilityTopic));
+  if (_transport->connect(getStationName(), availabilityTopic, 1, true, "offline", !_mqttPersistentSession)) {
+    _mqttReconnections = 0;
+    // Paces reconnections against a broker that drops the session right after accepting it
     _mqttNextConnAtte = millis() + _mqtt_reconnection_retry_wait_millis;
-    #ifdef LOGGING
-    debug(F("Connecting MQTT broker as"), getStationName());
+    LOG_INFO(F("MQTT broker Connected"));
+    #ifdef METRICS
+    if (_mqttConnectedOnce) {
+      ++_metrics.reconnections;
+    }
+    _mqttConnectedOnce = true;
     #endif
-    if (_mqttClient.connect(getStationName())) {
-      _mqttReconnections = 0;
-      #ifdef LOGGING
-      debug(F("MQTT broker Connected"));
-      #endif
-      // subscribe station to any command
-      String topic = getStationTopic("command/#");
-      _mqttClient.subscribe(topic.c_str());
-      #ifdef LOGGING
-      debug(F("Subscribed to"), topic.c_str());
-      #endif
+    buildTopicDispatch();
+    // subscribe station to any command
+    char topic[_topicMaxLength];
+    getStationTopic("command/#", topic, sizeof(topic));
+    _transport->subscribe(topic, _mqtt_subscription_qos);
+    LOG_DEBUG(F("Subscribed to"), topic);
+    if (_mqttCollapsedSubscriptions) {
+      // subscribe any channel to any command, the dispatcher tells the channels apart
+      getStationTopic("+/command/+", topic, sizeof(topic));
+      _transport->subscribe(topic, _mqtt_subscription_qos);
+      LOG_DEBUG(F("Subscribed to"), topic);
+    } else {
       // subscribe channels to any command
       for (size_t i = 0; i < getChannelsCount(); ++i) {
-        topic = getChannelTopic(getChannel(i), "command/+");
-        #ifdef LOGGING
-        debug(F("Subscribed to"), topic.c_str());
-        #endif
-        _mqttClient.subscribe(topic.c_str());
-      }
-      if (_mqttConnectionCallback) {
-        _mqttConnectionCallback();
+        getChannelTopic(getChannel(i), "command/+", topic, sizeof(topic));
+        LOG_DEBUG(F("Subscribed to"), topic);
+        _transport->subscribe(topic, _mqtt_subscription_qos);
       }
-    } else {
-      #ifdef LOGGING
-      debug(F("Failed. RC:"), _mqttClient.state());
-      #endif
     }
+    _transport->publish(availabilityTopic, "online", true);
+    flushPendingFeedback();
+    publishSnapshot();
+    _mqttConnectMillis = millis() - connectStart;
+    LOG_INFO(F("MQTT connection took (millis)"), _mqttConnectMillis);
+    #ifdef METRICS
+    _metrics.connectMillis = _mqttConnectMillis;
+    #endif
+    if (_mqttConnectionCallback) {
+      _mqttConnectionCallback();
+    }
+  } else {
+    LOG_WARN(F("Failed. RC:"), _transport->state());
+    scheduleBrokerReconnection();
   }
 }
+
+void ESPDomotic::scheduleBrokerReconnection() {
+  unsigned long wait;
+  if (++_mqttReconnections >= _mqtt_reconnection_max_retries) {
+    // Instead of giving up for good, rest for the longest wait and start over
+    LOG_WARN(F("Max MQTT reconnection retries reached, resting (millis)"), _mqtt_reconnection_max_wait_millis);
+    _mqttReconnections = 0;
+    wait = _mqtt_reconnection_max_wait_millis;
+  } else {
+    wait = _mqtt_reconnection_retry_wait_millis;
+    for (unsigned int i = 1; i < _mqttReconnections && wait < _mqtt_reconnection_max_wait_millis; ++i) {
+      wait <<= 1;
+    }
+    if (wait > _mqtt_reconnection_max_wait_millis) {
+      wait = _mqtt_reconnection_max_wait_millis;
+    }
+  }
+  // Jitter spreads the reconnections of modules that lost the broker at the same time
+  wait = wait / 2 + random(wait / 2 + 1);
+  LOG_DEBUG(F("Next MQTT connection attempt in (millis)"), wait);
+  _mqttNextConnAtte = millis() + wait;
+}
 #endif
 
+void ESPDomotic::tickInputs() {
+  InputEvent event;
+  while (_inputEvents.pop(&event)) {
+    // Each edge restarts the wait for the pin to be stable
+    _inputSettleAt[event.channel] = event.time + _channels[event.channel]->debounce;
+    _pendingInputs |= 1UL << event.channel;
+  }
+  unsigned long now = millis();
+  if (_inputEvents.takeOverflowed()) {
+    // Edges were lost, every input is read again once stable
+    LOG_WARN(F("Input events queue full"));
+    for (uint8_t i = 0; i < _channelsCount; ++i) {
+      if (_inputChannels & (1UL << i)) {
+        _inputSettleAt[i] = now + _channels[i]->debounce;
+      }
+    }
+    _pendingInputs |= _inputChannels;
+  }
+  for (uint8_t i = 0; i < _channelsCount && (_polledInputs >> i); ++i) {
+    if (_polledInputs & (1UL << i)) {
+      uint8_t read = digitalRead(_channels[i]->pin);
+      if (read != _inputLastRead[i]) {
+        _inputLastRead[i] = read;
+        _inputSettleAt[i] = now + _channels[i]->debounce;
+        _pendingInputs |= 1UL << i;
+      }
+    }
+  }
+  for (uint8_t i = 0; i < _channelsCount && (_pendingInputs >> i); ++i) {
+    if ((_pendingInputs & (1UL << i)) && deadlineReached(now, _inputSettleAt[i])) {
+      _pendingInputs &= ~(1UL << i);
+      uint8_t state = digitalRead(_channels[i]->pin);
+      // A bounce back to the previous state is not a change
+      if (state != _channels[i]->state) {
+        handleInputChange(_channels[i], state);
+      }
+    }
+  }
+}
+
+void ESPDomotic::handleInputChange(Channel* input, uint8_t state) {
+  input->state = state;
+  if (!input->isEnabled()) {
+    return;
+  }
+  LOG_DEBUG(F("Input channel changed"), input->name);
+  publishChannelFeedback(input, FEEDBACK_STATE);
+  Channel* output = input->boundOutput;
+  if (output && output->isEnabled() && updateChannelState(output, output->state == LOW ? HIGH : LOW)) {
+    // As when changed through mqtt, so the output timer runs
+    output->locallyChanged = !output->locallyChanged;
+    scheduleChannelsTimers();
+  }
+}
+
 void ESPDomotic::checkChannelsTimers() {
-  for (size_t i = 0; i < getChannelsCount(); ++i) {
-    Channel *channel = getChannel(i);
+  unsigned long now = millis();
+  for (uint8_t i = 0; i < _channelsCount && (_armedTimers >> i); ++i) {
+    if (!(_armedTimers & (1UL << i))) {
+      continue;
+    }
+    Channel *channel = _channels[i];
     // Timer is checked just if the channel state was changed from the logic inside this lib (locally changed)
-    if (channel->locallyChanged && channel->timeIsUp()) {
-      #ifdef LOGGING
-      debug("Timer triggered for channel", channel->name);
-      #endif
+    if (channel->locallyChanged && channel->timeIsUp(now)) {
+      LOG_INFO(F("Timer triggered for channel"), channel->name);
       // Flip the channel state
       uint8_t state = channel->state == LOW ? HIGH : LOW;
       if (updateChannelState(channel, state)) {
@@ -200,213 +667,467 @@ void ESPDomotic::checkChannelsTimers() {
       }
     }
   }
+  scheduleChannelsTimers();
+}
+
+void ESPDomotic::scheduleChannelsTimers() {
+  _armedTimers = 0;
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    Channel *channel = _channels[i];
+    if (channel->locallyChanged && channel->timerControl != 0) {
+      if (!_armedTimers || deadlineBefore(channel->timerControl, _nextTimerDeadline)) {
+        _nextTimerDeadline = channel->timerControl;
+      }
+      _armedTimers |= 1UL << i;
+    }
+  }
+}
+
+unsigned long ESPDomotic::getNextTimerDeadline() {
+  return _armedTimers ? _nextTimerDeadline : 0;
 }
 
 #ifndef MQTT_OFF
 void ESPDomotic::receiveMqttMessage(char* topic, uint8_t* payload, unsigned int length) {
-  String sTopic = String(topic);
-  #ifdef LOGGING
-  debug(F("MQTT message received on topic"), sTopic);
-  #endif
-  if (getStationTopic("command/hrst").equals(sTopic)) {
-    moduleHardReset();
-  } else if (getStationTopic("command/rst").equals(sTopic)) {
-    moduleSoftReset();
-  } else {
-    for (size_t i = 0; i < getChannelsCount(); ++i) {
-      Channel *channel = getChannel(i);
-      if (sTopic.endsWith(String(channel->name) + F("/command/enable"))) {
-        if (enableChannelCommand(channel, payload, length)) {
-          saveChannelsSettings();
-        }
-        _mqttClient.publish(getChannelTopic(channel, "feedback/enable").c_str(), channel->isEnabled() ? "1" : "0");
-      } else if (sTopic.endsWith(String(channel->name) + F("/command/timer"))) {
-        if (updateChannelTimerCommand(channel, payload, length)) {
-          saveChannelsSettings();
-        }
-      } else if (sTopic.endsWith(String(channel->name) + F("/command/rename"))) {
-        if (renameChannelCommand(channel, payload, length)) {
-          saveChannelsSettings();
-        }
-      } else if (channel->pinMode == OUTPUT && sTopic.endsWith(String(channel->name) + F("/command/state"))) {
-        // command/state topic is used to change the state on the channel with a desired value. So, receiving a mqtt
-        // message with this purpose has sense only if the channel is an output one.
-        if (channel->isEnabled()) {
-          if (changeStateCommand(channel, payload, length)) {
-            if (channel->locallyChanged) {
-              channel->locallyChanged = false;
-            } else {
-              channel->locallyChanged = true;
-            }
+  // The topic points into the mqtt client buffer, wich gets overwritten by any publish done while processing the message
+  strncpy(_receivedTopic, topic, sizeof(_receivedTopic) - 1);
+  _receivedTopic[sizeof(_receivedTopic) - 1] = '\0';
+  LOG_DEBUG(F("MQTT message received on topic"), _receivedTopic);
+  uint8_t i = 0;
+  Channel *channel;
+  // Whether a command addressed to the module was carried out. Messages on other topics are left to the user callback.
+  bool accepted = true;
+  bool changed;
+  MqttCommand command = _topicDispatcher.resolve(_receivedTopic, &i);
+  switch (command) {
+    case CMD_HARD_RESET:
+      moduleHardReset();
+      break;
+    case CMD_SOFT_RESET:
+      moduleSoftReset();
+      break;
+    case CMD_STATES:
+      accepted = changeStatesCommand(payload, length);
+      break;
+    case CMD_ENABLE:
+      channel = getChannel(i);
+      changed = enableChannelCommand(channel, payload, length, &accepted);
+      if (changed) {
+        scheduleChannelsSettingsSave();
+      }
+      publishChannelFeedback(channel, FEEDBACK_ENABLE);
+      break;
+    case CMD_TIMER:
+      channel = getChannel(i);
+      changed = updateChannelTimerCommand(channel, payload, length, &accepted);
+      if (changed) {
+        scheduleChannelsSettingsSave();
+      }
+      break;
+    case CMD_RENAME:
+      channel = getChannel(i);
+      changed = renameChannelCommand(channel, payload, length, &accepted);
+      if (changed) {
+        scheduleChannelsSettingsSave();
+      }
+      break;
+    case CMD_STATE:
+      channel = getChannel(i);
+      // command/state topic is used to change the state on the channel with a desired value. So, receiving a mqtt
+      // message with this purpose has sense only if the channel is an output one.
+      if (channel->pinMode != OUTPUT) {
+        accepted = false;
+        break;
+      }
+      if (channel->isEnabled()) {
+        changed = changeStateCommand(channel, payload, length, &accepted);
+        if (changed) {
+          if (channel->locallyChanged) {
+            channel->locallyChanged = false;
+          } else {
+            channel->locallyChanged = true;
           }
-        } else {
-          _mqttClient.publish(getChannelTopic(channel, "feedback/state").c_str(), channel->state == LOW ? "1" : "0");
+          scheduleChannelsTimers();
         }
+      } else {
+        publishChannelFeedback(channel, FEEDBACK_STATE);
       }
+      break;
+    default:
+      break;
+  }
+  #ifdef METRICS
+  if (command != CMD_UNKNOWN) {
+    if (accepted) {
+      ++_metrics.messagesHandled;
+    } else {
+      ++_metrics.messagesDropped;
     }
   }
+  #endif
   if (_mqttMessageCallback) {
-    #ifdef LOGGING
-    debug(F("Passing mqtt callback to user"));
-    #endif
-    // Workaround necesario porque el topic recibido desde mqtt se blanqueaba luego de un publish invocado dentro de la iteracion de los canales.
-    _mqttMessageCallback(&sTopic[0], payload, length);
+    LOG_DEBUG(F("Passing mqtt callback to user"));
+    _mqttMessageCallback(_receivedTopic, payload, length);
+  }
+}
+
+bool ESPDomotic::sendChannelFeedback(Channel* channel, ChannelFeedback feedback) {
+  char topic[_topicMaxLength];
+  if (feedback == FEEDBACK_ENABLE) {
+    getChannelTopic(channel, "feedback/enable", topic, sizeof(topic));
+    return _transport->publish(topic, channel->isEnabled() ? "1" : "0");
+  }
+  getChannelTopic(channel, "feedback/state", topic, sizeof(topic));
+  return _transport->publish(topic, channel->state == LOW ? "1" : "0");
+}
+
+void ESPDomotic::publishSnapshot() {
+  static const char head[] = "{\"channels\":[";
+  static const char tail[] = "]}";
+  // The message length goes first, so entries are measured before being sent
+  size_t length = sizeof(head) - 1 + sizeof(tail) - 1;
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    BufferPrint entry(NULL, 0);
+    printChannelSnapshot(entry, _channels[i]);
+    if (entry.length > _snapshotEntryMaxLength - 1) {
+      LOG_WARN(F("Snapshot entry too long, channel"), _channels[i]->name);
+      return;
+    }
+    length += entry.length + (i > 0 ? 1 : 0);
+  }
+  char topic[_topicMaxLength];
+  getStationTopic("snapshot", topic, sizeof(topic));
+  if (!_transport->beginPublish(topic, length, true)) {
+    LOG_WARN(F("Failed to publish the station snapshot"));
+    return;
+  }
+  _transport->write((const uint8_t*) head, sizeof(head) - 1);
+  char buff[_snapshotEntryMaxLength];
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    BufferPrint entry(buff, sizeof(buff));
+    if (i > 0) {
+      entry.print(',');
+    }
+    printChannelSnapshot(entry, _channels[i]);
+    _transport->write((const uint8_t*) buff, entry.kept());
+  }
+  _transport->write((const uint8_t*) tail, sizeof(tail) - 1);
+  _transport->endPublish();
+}
+
+void ESPDomotic::printChannelSnapshot(Print& out, Channel* channel) {
+  out.print(F("{\"id\":\""));
+  printJsonText(out, channel->id);
+  out.print(F("\",\"name\":\""));
+  printJsonText(out, channel->name);
+  out.print(F("\",\"state\":"));
+  out.print(channel->state == LOW ? 1 : 0);
+  out.print(F(",\"enabled\":"));
+  out.print(channel->isEnabled() ? 1 : 0);
+  out.print(F(",\"timer\":"));
+  out.print(channel->timer > INT32_MAX ? -1L : (long) (channel->timer / 1000));
+  out.print('}');
+}
+
+void ESPDomotic::publishStatesFeedback(uint32_t changed) {
+  char states[MAX_CHANNELS + 1];
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    states[i] = _channels[i]->state == LOW ? '1' : '0';
+  }
+  states[_channelsCount] = '\0';
+  char topic[_topicMaxLength];
+  getStationTopic("feedback/states", topic, sizeof(topic));
+  if (_transport->connected() && _transport->publish(topic, states)) {
+    return;
+  }
+  for (uint8_t i = 0; i < _channelsCount && (changed >> i); ++i) {
+    if (changed & (1UL << i)) {
+      _pendingFeedback.push(_channels[i], FEEDBACK_STATE);
+    }
+  }
+}
+
+void ESPDomotic::flushPendingFeedback() {
+  Channel* channel;
+  ChannelFeedback feedback;
+  while (_pendingFeedback.peek(&channel, &feedback)) {
+    if (!sendChannelFeedback(channel, feedback)) {
+      // Connection lost again, remaining feedback waits for the next connection
+      break;
+    }
+    _pendingFeedback.pop();
+  }
+}
+
+void ESPDomotic::buildTopicDispatch() {
+  if (_topicPrefixLength == 0) {
+    buildTopicPrefix();
+  }
+  const char* names[MAX_CHANNELS];
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    names[i] = _channels[i]->name;
+  }
+  _topicDispatcher.build(_topicPrefix, names, _channelsCount);
+}
+
+void ESPDomotic::buildTopicPrefix() {
+  size_t size = snprintf(_topicPrefix, sizeof(_topicPrefix), "%s/%s/%s/", getModuleType(), getModuleLocation(), getModuleName());
+  if (size >= sizeof(_topicPrefix)) {
+    LOG_WARN(F("Station topic prefix truncated"), _topicPrefix);
+    size = sizeof(_topicPrefix) - 1;
+  }
+  _topicPrefixLength = size;
+}
+
+#ifdef MQTT_LOG
+void ESPDomotic::queueLog(LogLevel level, const char* line, size_t length) {
+  _logRing.push(level, line, length);
+}
+
+void ESPDomotic::drainLog() {
+  if (!deadlineReached(millis(), _logDrainAt) || _logRing.isEmpty() || !_transport->connected()) {
+    return;
+  }
+  _logDrainAt = millis() + _mqtt_log_drain_period_millis;
+  char line[_logLineMaxLength + 3];
+  char topic[_topicMaxLength];
+  getStationTopic("log", topic, sizeof(topic));
+  size_t spent = 0;
+  uint16_t dropped = _logRing.takeDropped();
+  if (dropped > 0) {
+    spent = snprintf(line, sizeof(line), "W %u log lines dropped", dropped);
+    _transport->publish(topic, line);
+  }
+  uint8_t level;
+  while (spent < _mqtt_log_budget && !_logRing.isEmpty()) {
+    size_t length = _logRing.peek(&level, line + 2, sizeof(line) - 2);
+    line[0] = _logLevelCodes[level <= DOMOTIC_LOG_LEVEL_DEBUG ? level : 0];
+    line[1] = ' ';
+    if (!_transport->publish(topic, (const uint8_t*) line, length + 2, false)) {
+      // Kept for the next drain
+      break;
+    }
+    _logRing.pop();
+    spent += length + 2;
   }
 }
 #endif
 
-bool ESPDomotic::changeStateCommand(Channel* channel, uint8_t* payload, unsigned int length) {
-  #ifdef LOGGING
-  debug(F("Processing command to change channel state"), channel->name);
-  #endif
-  if (length < 1) {
-    #ifdef LOGGING
-    debug(F("Invalid payload"));
-    #endif
-    return false;
+#ifdef METRICS
+void ESPDomotic::publishMetrics() {
+  _metricsPublishAt = millis() + _metrics_period_millis;
+  if (_transport->connected()) {
+    char payload[256];
+    size_t length = _metrics.format(payload, sizeof(payload), ESP.getFreeHeap(), ESP.getMaxFreeBlockSize());
+    if (length > 0) {
+      char topic[_topicMaxLength];
+      getStationTopic("metrics", topic, sizeof(topic));
+      _transport->publish(topic, (const uint8_t*) payload, length, false);
+    }
   }
-  switch (payload[0]) {
-    case '0':
-      return updateChannelState(channel, HIGH);
-    case '1':
-      return updateChannelState(channel, LOW);
-    default:
-      #ifdef LOGGING
-      debug(F("Invalid state"), payload[0]);
-      #endif
+  _metrics.resetLoop();
+}
+#endif
+#endif
+
+bool ESPDomotic::changeStateCommand(Channel* channel, uint8_t* payload, unsigned int length, bool* valid) {
+  LOG_DEBUG(F("Processing command to change channel state"), channel->name);
+  bool on;
+  bool parsed = PayloadView(payload, length).toBool(&on);
+  if (valid) {
+    *valid = parsed;
+  }
+  if (!parsed) {
+    LOG_WARN(F("Invalid payload"));
     return false;
   }
+  return updateChannelState(channel, on ? LOW : HIGH);
 }
 
 bool ESPDomotic::updateChannelState (Channel* channel, uint8_t s) {
   bool updated;
   if (channel->state == s) {
-    #ifdef LOGGING
-    debug(F("Channel is in same state, skipping"), s);
-    #endif
+    LOG_DEBUG(F("Channel is in same state, skipping"), s);
     updated = false;
   } else {
-    #ifdef LOGGING
-    debug(F("Changing channel state to"), channel->state == HIGH ? "[ON]" : "[OFF]");
-    #endif
+    LOG_INFO(F("Changing channel state to"), channel->state == HIGH ? F("[ON]") : F("[OFF]"));
     channel->state = s;
     digitalWrite(channel->pin, channel->state);
     if (channel->state == LOW) {
-      #ifdef LOGGING
-      debug(F("Setting timer control (seconds)"), channel->timer / 1000);
-      #endif
+      LOG_DEBUG(F("Setting timer control (seconds)"), channel->timer / 1000);
       channel->updateTimerControl();
     } else {
-      #ifdef LOGGING
-      debug(F("Resetting timer control"));
-      #endif
+      LOG_DEBUG(F("Resetting timer control"));
       // Setting timerControl to 0 means no need of further timer checking
       channel->timerControl = 0;
     }
+    scheduleChannelsTimers();
+    if (_persistChannelsState) {
+      scheduleChannelsSettingsSave();
+    }
     updated = true;
   }
-  _mqttClient.publish(getChannelTopic(channel, "feedback/state").c_str(), channel->state == LOW ? "1" : "0");
+  publishChannelFeedback(channel, FEEDBACK_STATE);
   return updated;
 }
 
-void ESPDomotic::moduleHardReset () {
-  #ifdef LOGGING
-  debug(F("Doing a module hard reset"));
+bool ESPDomotic::changeStatesCommand(uint8_t* payload, unsigned int length) {
+  LOG_DEBUG(F("Processing command to change channels states"));
+  uint32_t on, off;
+  if (!PayloadView(payload, length).toChannelsStates(_channelsCount, &on, &off)) {
+    LOG_WARN(F("Invalid payload"));
+    return false;
+  }
+  uint32_t changed = 0;
+  // Pins GPIO0-15 to drive high and low, written at once through the gpio registers
+  uint32_t pinsHigh = 0;
+  uint32_t pinsLow = 0;
+  for (uint8_t i = 0; i < _channelsCount && ((on | off) >> i); ++i) {
+    Channel* channel = _channels[i];
+    if (!((on | off) & (1UL << i)) || channel->pinMode != OUTPUT || !channel->isEnabled()) {
+      continue;
+    }
+    uint8_t state = on & (1UL << i) ? LOW : HIGH;
+    if (channel->state == state) {
+      continue;
+    }
+    channel->state = state;
+    if (channel->pin < 16) {
+      if (state == HIGH) {
+        pinsHigh |= 1UL << channel->pin;
+      } else {
+        pinsLow |= 1UL << channel->pin;
+      }
+    } else {
+      digitalWrite(channel->pin, state);
+    }
+    if (state == LOW) {
+      channel->updateTimerControl();
+    } else {
+      channel->timerControl = 0;
+    }
+    // As a single state command does
+    channel->locallyChanged = !channel->locallyChanged;
+    changed |= 1UL << i;
+  }
+  if (pinsHigh) {
+    GPOS = pinsHigh;
+  }
+  if (pinsLow) {
+    GPOC = pinsLow;
+  }
+  if (changed) {
+    LOG_INFO(F("Channels states changed"), changed);
+    scheduleChannelsTimers();
+    if (_persistChannelsState) {
+      scheduleChannelsSettingsSave();
+    }
+  }
+  #ifndef MQTT_OFF
+  publishStatesFeedback(changed);
   #endif
+  return true;
+}
+
+void ESPDomotic::publishChannelFeedback (Channel* channel, ChannelFeedback feedback) {
+  #ifndef MQTT_OFF
+  bool published = _transport->connected() && sendChannelFeedback(channel, feedback);
+  if (!published && !_pendingFeedback.push(channel, feedback)) {
+    LOG_WARN(F("Feedback queue full, dropping feedback of channel"), channel->name);
+    #ifdef METRICS
+    ++_metrics.feedbackDropped;
+    #endif
+  }
+  #else
+  (void) channel;
+  (void) feedback;
+  #endif
+}
+
+void ESPDomotic::moduleHardReset () {
+  LOG_INFO(F("Doing a module hard reset"));
+  // Settings are about to be erased, no need to write them
+  _settingsDirty = false;
   LittleFS.format();
+  memset(_fileCache, 0, sizeof(_fileCache));
   WiFi.disconnect();
   delay(200);
   ESP.restart();
 }
 
 void ESPDomotic::moduleSoftReset () {
-  #ifdef LOGGING
-  debug(F("Doing a module soft reset"));
-  #endif
+  LOG_INFO(F("Doing a module soft reset"));
+  flushChannelsSettings();
   WiFi.disconnect();
   delay(200);
   ESP.restart();
 }
 
-bool ESPDomotic::enableChannelCommand(Channel* channel, unsigned char* payload, unsigned int length) {
-  #ifdef LOGGING
-  debug(F("Updating channel enablement"), channel->name);
-  #endif
-  if (length != 1 || !payload) {
-    #ifdef LOGGING
-    debug(F("Invalid payload. Ignoring."));
-    #endif
-    return false;
+bool ESPDomotic::enableChannelCommand(Channel* channel, unsigned char* payload, unsigned int length, bool* valid) {
+  LOG_DEBUG(F("Updating channel enablement"), channel->name);
+  bool enabled;
+  bool parsed = PayloadView(payload, length).toBool(&enabled);
+  if (valid) {
+    *valid = parsed;
   }
-  bool stateChanged = false;
-  switch (payload[0]) {
-    case '0':
-      stateChanged = channel->enabled;
-      channel->enabled = false;
-      break;
-    case '1':
-      stateChanged = !channel->enabled;
-      channel->enabled = true;
-      break;
-    default:
-      #ifdef LOGGING
-      debug(F("Invalid state"), payload[0]);
-      #endif
-      break;
+  if (!parsed) {
+    LOG_WARN(F("Invalid payload. Ignoring."));
+    return false;
   }
+  bool stateChanged = channel->enabled != enabled;
+  channel->enabled = enabled;
   return stateChanged;
 }
 
-bool ESPDomotic::renameChannelCommand(Channel* channel, uint8_t* payload, unsigned int length) {
-  #ifdef LOGGING
-  debug(F("Processing command to update channel name"), channel->name);
-  #endif
-  if (length < 1) {
-    #ifdef LOGGING
-    debug(F("Invalid payload"));
-    #endif
-    return false;
+bool ESPDomotic::renameChannelCommand(Channel* channel, uint8_t* payload, unsigned int length, bool* valid) {
+  LOG_DEBUG(F("Processing command to update channel name"), channel->name);
+  // The name is used as a topic level, so it cant hold mqtt separators nor wildcards
+  char newName[_channelNameMaxLength];
+  bool parsed = PayloadView(payload, length).toTopicLevel(newName, sizeof(newName));
+  if (valid) {
+    *valid = parsed;
   }
-  char newName[length + 1];
-  for (uint16_t i = 0 ; i < length; ++ i) {
-    newName[i] = payload[i];
+  if (!parsed) {
+    LOG_WARN(F("Invalid payload"));
+    return false;
   }
-  newName[length] = '\0';
-  bool renamed = !String(channel->name).equals(String(newName));
+  bool renamed = strcmp(channel->name, newName) != 0;
   if (renamed) {
-    #ifdef LOGGING
-    debug(F("New channel name"), newName);
-    #endif
+    LOG_INFO(F("New channel name"), newName);
     #ifndef MQTT_OFF
-    _mqttClient.unsubscribe(getChannelTopic(channel, "command/+").c_str());
+    char topic[_topicMaxLength];
+    if (!_mqttCollapsedSubscriptions) {
+      getChannelTopic(channel, "command/+", topic, sizeof(topic));
+      _transport->unsubscribe(topic);
+    }
+    #endif
     channel->updateName(newName);
-    _mqttClient.subscribe(getChannelTopic(channel, "command/+").c_str());
+    #ifndef MQTT_OFF
+    buildTopicDispatch();
+    if (!_mqttCollapsedSubscriptions) {
+      getChannelTopic(channel, "command/+", topic, sizeof(topic));
+      _transport->subscribe(topic, _mqtt_subscription_qos);
+    }
     #endif
   }
   return renamed;
 }
 
-bool ESPDomotic::updateChannelTimerCommand(Channel* channel, uint8_t* payload, unsigned int length) {
-  #ifdef LOGGING
-  debug(F("Processing command to change channel timer"), channel->name);
-  #endif
-  if (length < 1) {
-    #ifdef LOGGING
-    debug(F("Invalid payload"));
-    #endif
-    return false;
+bool ESPDomotic::updateChannelTimerCommand(Channel* channel, uint8_t* payload, unsigned int length, bool* valid) {
+  LOG_DEBUG(F("Processing command to change channel timer"), channel->name);
+  // Received in seconds, kept in millis. Longer timers could not be told apart from expired ones.
+  unsigned long newTimer;
+  bool parsed = PayloadView(payload, length).toUnsigned(INT32_MAX / 1000, &newTimer);
+  if (valid) {
+    *valid = parsed;
   }
-  char buff[length + 1];
-  for (uint16_t i = 0 ; i < length; ++ i) {
-    buff[i] = payload[i];
+  if (!parsed) {
+    LOG_WARN(F("Invalid payload"));
+    return false;
   }
-  buff[length] = '\0';
-  long newTimer = String(buff).toInt();
-  #ifdef LOGGING
-  debug(F("New timer in seconds"), newTimer);
-  #endif
-  bool timerChanged = channel->timer != (unsigned long) newTimer * 1000;
-  channel->timer = newTimer * 1000; // received in seconds set in millis
+  LOG_INFO(F("New timer in seconds"), newTimer);
+  bool timerChanged = channel->timer != newTimer * 1000;
+  channel->timer = newTimer * 1000;
   return timerChanged;
 }
 
@@ -415,6 +1136,18 @@ void ESPDomotic::setMqttConnectionCallback(std::function<void()> callback) {
     _mqttConnectionCallback = callback;
 }
 
+void ESPDomotic::setMqttPersistentSession(bool persistent) {
+  _mqttPersistentSession = persistent;
+}
+
+void ESPDomotic::setMqttCollapsedSubscriptions(bool collapsed) {
+  _mqttCollapsedSubscriptions = collapsed;
+}
+
+unsigned long ESPDomotic::getMqttConnectMillis() {
+  return _mqttConnectMillis;
+}
+
 void ESPDomotic::setMqttMessageCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) {
   _mqttMessageCallback = callback;
 }
@@ -432,18 +1165,26 @@ void ESPDomotic::setPortalSSID (const char* ssid) {
   _apSSID = ssid;
 }
 
-void ESPDomotic::addChannel(Channel *channel) {
+bool ESPDomotic::addChannel(Channel *channel) {
   if (_channelsCount < MAX_CHANNELS) {
     _channels[_channelsCount++] = channel;
-  } else {
-    #ifdef LOGGING
-    debug(F("No more channels suported"));
-    #endif
+    return true;
+  }
+  LOG_WARN(F("No more channels suported. MAX_CHANNELS"), MAX_CHANNELS);
+  return false;
+}
+
+bool ESPDomotic::bindInputChannel(Channel* input, Channel* output) {
+  if (input->pinMode == OUTPUT || (output && output->pinMode != OUTPUT)) {
+    LOG_WARN(F("Channels can not be bound"), input->name);
+    return false;
   }
+  input->boundOutput = output;
+  return true;
 }
 
 Channel *ESPDomotic::getChannel(uint8_t i) {
-  if (i <= _channelsCount) {
+  if (i < _channelsCount) {
     return _channels[i];
   } else {
     return NULL;
@@ -494,6 +1235,14 @@ const char* ESPDomotic::getStationName () {
 PubSubClient* ESPDomotic::getMqttClient() {
   return &_mqttClient;
 }
+
+void ESPDomotic::setTransport(MessageTransport* transport) {
+  _transport = transport;
+}
+
+MessageTransport* ESPDomotic::getTransport() {
+  return _transport;
+}
 #endif
 
 ESP8266WebServer* ESPDomotic::getHttpServer() {
@@ -501,89 +1250,319 @@ ESP8266WebServer* ESPDomotic::getHttpServer() {
 }
 
 #ifndef MQTT_OFF
+// Copies the part into buff starting at pos, truncating it to fit. Returns the position after the copied chars.
+static size_t appendTopicPart (char* buff, size_t size, size_t pos, const char* part) {
+  while (*part && pos + 1 < size) {
+    buff[pos++] = *part++;
+  }
+  buff[pos] = '\0';
+  return pos;
+}
+
+size_t ESPDomotic::getStationTopic (const char* suffix, char* buff, size_t size) {
+  if (size == 0) {
+    return 0;
+  }
+  if (_topicPrefixLength == 0) {
+    buildTopicPrefix();
+  }
+  size_t pos = _topicPrefixLength < size ? _topicPrefixLength : size - 1;
+  memcpy(buff, _topicPrefix, pos);
+  return appendTopicPart(buff, size, pos, suffix);
+}
+
+size_t ESPDomotic::getChannelTopic (Channel *channel, const char* suffix, char* buff, size_t size) {
+  size_t pos = getStationTopic(channel->name, buff, size);
+  pos = appendTopicPart(buff, size, pos, "/");
+  return appendTopicPart(buff, size, pos, suffix);
+}
+
 String ESPDomotic::getChannelTopic (Channel *channel, String suffix) {
-  return String(getModuleType()) + F("/") + getModuleLocation() + F("/") + getModuleName() + F("/") + channel->name + F("/") + suffix;
+  char topic[_topicMaxLength];
+  getChannelTopic(channel, suffix.c_str(), topic, sizeof(topic));
+  return String(topic);
 }
 
 String ESPDomotic::getStationTopic (String suffix) {
-  return String(getModuleType()) + F("/") + getModuleLocation() + F("/") + getModuleName() + F("/") + suffix;
+  char topic[_topicMaxLength];
+  getStationTopic(suffix.c_str(), topic, sizeof(topic));
+  return String(topic);
+}
+#endif
+
+// Files the module itself keeps, wich are never taken as legacy conf values
+static bool isModuleFile (const char* fileName) {
+  return strcmp(fileName, "/config.json") == 0 || strcmp(fileName, "/settings.json") == 0 || strcmp(fileName, "/conf.kv") == 0;
+}
+
+/*
+  Sizes and existence of the module files are cached, so looking them up does not hit flash again.
+  Entries are invalidated whenever the module writes the file. Other files may be written by the sketch
+  behind the module back, so they are never cached.
+*/
+static FileCacheEntry* findCachedFile (const char* fileName) {
+  for (uint8_t i = 0; i < _fileCacheSize; ++i) {
+    if (_fileCache[i].name[0] != '\0' && strcmp(_fileCache[i].name, fileName) == 0) {
+      return &_fileCache[i];
+    }
+  }
+  return NULL;
+}
+
+static void cacheFile (const char* fileName, bool exists, size_t size) {
+  if (!isModuleFile(fileName)) {
+    return;
+  }
+  FileCacheEntry* entry = findCachedFile(fileName);
+  if (!entry) {
+    entry = &_fileCache[_fileCacheNext];
+    _fileCacheNext = (_fileCacheNext + 1) % _fileCacheSize;
+  }
+  strncpy(entry->name, fileName, sizeof(entry->name) - 1);
+  entry->name[sizeof(entry->name) - 1] = '\0';
+  entry->exists = exists;
+  entry->size = size;
+}
+
+static void invalidateCachedFile (const char* fileName) {
+  FileCacheEntry* entry = findCachedFile(fileName);
+  if (entry) {
+    entry->name[0] = '\0';
+  }
+}
+
+/*
+  Files are never truncated in place. The new content is written to a temp file wich then replaces the live one
+  through a rename, an atomic operation in LittleFS. A power loss mid write leaves the previous content untouched.
+*/
+static File openAtomicWrite (const char* fileName, char* tmpName, size_t size) {
+  snprintf(tmpName, size, "%s.tmp", fileName);
+  return LittleFS.open(tmpName, "w");
+}
+
+// Closes the temp file and, if it was fully written, makes it the live one
+static bool commitAtomicWrite (File& file, const char* fileName, const char* tmpName, bool written) {
+  file.close();
+  invalidateCachedFile(fileName);
+  if (written && LittleFS.rename(tmpName, fileName)) {
+    return true;
+  }
+  LittleFS.remove(tmpName);
+  return false;
+}
+
+#ifdef USE_BINARY_SETTINGS
+/*
+  Binary records layout: a header followed by a fixed layout body, protected by a CRC32.
+  Records are read in a single read straight into the struct.
+*/
+const uint16_t  _binaryRecordVersion    = 2;
+// Oldest version still read. Version 1 channels records do not keep the state, config records did not change.
+const uint16_t  _binaryRecordMinVersion = 1;
+const uint32_t  _configRecordMagic      = 0x47464344; // "DCFG"
+const uint32_t  _settingsRecordMagic    = 0x4E484344; // "DCHN"
+const uint8_t   _channelIdMaxLength     = 8;
+
+struct BinaryHeader {
+  uint32_t      magic;
+  uint16_t      version;
+  uint16_t      length;   // bytes following the header
+  uint32_t      crc;      // CRC32 of the bytes following the header
+};
+
+struct ConfigRecord {
+  BinaryHeader  header;
+  char          moduleLocation[_paramValueMaxLength + 1];
+  char          moduleName[_paramValueMaxLength + 1];
+  char          mqttHost[_paramIPValueLength + 1];
+  char          mqttPort[_paramPortValueLength + 1];
+};
+
+struct ChannelRecord {
+  char          id[_channelIdMaxLength];
+  char          name[_channelNameMaxLength + 1];
+  uint8_t       enabled;
+  uint8_t       state;
+  uint32_t      timer;
+};
+
+struct ChannelRecordV1 {
+  char          id[_channelIdMaxLength];
+  char          name[_channelNameMaxLength + 1];
+  uint8_t       enabled;
+  uint32_t      timer;
+};
+
+struct SettingsRecord {
+  BinaryHeader  header;
+  ChannelRecord channels[MAX_CHANNELS];
+};
+
+enum BinaryRecordStatus {
+  RECORD_OK,
+  RECORD_NOT_BINARY,
+  RECORD_CORRUPT
+};
+
+static void copyRecordField (char* field, size_t size, const char* value) {
+  strncpy(field, value ? value : "", size - 1);
+  field[size - 1] = '\0';
+}
+
+// Reads the record straight into the struct, wich must start with the header and be capacity bytes long
+static BinaryRecordStatus readBinaryRecord (const char* fileName, size_t size, uint32_t magic, BinaryHeader* record, size_t capacity) {
+  if (size < sizeof(BinaryHeader)) {
+    return RECORD_NOT_BINARY;
+  }
+  File file = LittleFS.open(fileName, "r");
+  if (!file) {
+    return RECORD_CORRUPT;
+  }
+  BinaryRecordStatus status = RECORD_CORRUPT;
+  if (file.read((uint8_t*) record, sizeof(BinaryHeader)) != sizeof(BinaryHeader) || record->magic != magic) {
+    // Text files written by previous firmwares end up here
+    status = RECORD_NOT_BINARY;
+  } else if (record->version >= _binaryRecordMinVersion && record->version <= _binaryRecordVersion && sizeof(BinaryHeader) + record->length == size && size <= capacity
+      && file.read((uint8_t*) (record + 1), record->length) == record->length
+      && crc32((uint8_t*) (record + 1), record->length) == record->crc) {
+    status = RECORD_OK;
+  }
+  file.close();
+  return status;
+}
+
+static bool writeBinaryRecord (const char* fileName, uint32_t magic, BinaryHeader* record, size_t length) {
+  record->magic = magic;
+  record->version = _binaryRecordVersion;
+  record->length = length;
+  record->crc = crc32((uint8_t*) (record + 1), length);
+  char tmpName[_fileNameMaxLength];
+  File file = openAtomicWrite(fileName, tmpName, sizeof(tmpName));
+  if (!file) {
+    return false;
+  }
+  size_t size = sizeof(BinaryHeader) + length;
+  return commitAtomicWrite(file, fileName, tmpName, file.write((uint8_t*) record, size) == size);
 }
 #endif
 
 bool ESPDomotic::loadConfig () {
+  #ifndef MQTT_OFF
+  // Topics are built from the config, the prefix cached so far may hold stale or empty levels
+  _topicPrefixLength = 0;
+  #endif
   size_t size = getFileSize("/config.json");
   if (size > 0) {
-    #ifdef USE_JSON
-    char buff[size];
-    loadFile("/config.json", buff, size);
-    StaticJsonDocument<200> doc;
-    DeserializationError error = deserializeJson(doc, buff);
-    if (!error) {
-      #ifndef MQTT_OFF
-      _mqttHost.updateValue(doc[_mqttHost.getName()]);
-      _mqttPort.updateValue(doc[_mqttPort.getName()]);
-      #endif
-      _moduleLocation.updateValue(doc[_moduleLocation.getName()]);
-      _moduleName.updateValue(doc[_moduleName.getName()]);
-      #ifdef LOGGING
-      serializeJsonPretty(doc, Serial);
-      #endif
-      return true;
-    } else {
-      #ifdef LOGGING
-      debug(F("Failed to load json config"), error.c_str());
-      #endif
-      return false;
-    }
-    #else
-    // Avoid using json to reduce build size
-    File configFile = LittleFS.open("/config.json", "r");
-    bool readOK = true;
-    while (readOK && configFile.position() < size) {
-      String line = configFile.readStringUntil('\n');
-      line.trim();
-      size_t ioc = line.indexOf('=');
-      if (ioc >= 0 && ioc + 1 < line.length()) {
-        String key = line.substring(0, ioc++);
-        String val = line.substring(ioc, line.length());
-        #ifdef LOGGING
-        debug(F("Read key"), key);
-        debug(F("Key value"), val);
-        #endif
+    #ifdef USE_BINARY_SETTINGS
+    ConfigRecord record;
+    switch (readBinaryRecord("/config.json", size, _configRecordMagic, &record.header, sizeof(record))) {
+      case RECORD_OK:
         #ifndef MQTT_OFF
-        if (key.equals(_mqttPort.getName())) {
-          _mqttPort.updateValue(val.c_str());
-        } else if (key.equals(_mqttHost.getName())) {
-          _mqttHost.updateValue(val.c_str());
-        } else
+        _mqttHost.updateValue(record.mqttHost);
+        _mqttPort.updateValue(record.mqttPort);
         #endif
-        if (key.equals(_moduleLocation.getName())) {
-          _moduleLocation.updateValue(val.c_str());
-        } else if (key.equals(_moduleName.getName())) {
-          _moduleName.updateValue(val.c_str());
-        } else {
-          #ifdef LOGGING
-          debug(F("ERROR. Unknown key"));
-          #endif
-          readOK = false;
+        _moduleLocation.updateValue(record.moduleLocation);
+        _moduleName.updateValue(record.moduleName);
+        return true;
+      case RECORD_NOT_BINARY:
+        // Written by a firmware using the text format, migrate it
+        if (loadTextConfig(size)) {
+          saveConfig();
+          return true;
         }
+        return false;
+      default:
+        LOG_ERROR(F("Corrupt config record"));
+        return false;
+    }
+    #else
+    return loadTextConfig(size);
+    #endif
+  }
+  return false;
+}
+
+bool ESPDomotic::loadTextConfig (size_t size) {
+  #ifdef USE_JSON
+  char buff[size];
+  loadFile("/config.json", buff, size);
+  StaticJsonDocument<200> doc;
+  DeserializationError error = deserializeJson(doc, buff);
+  if (!error) {
+    #ifndef MQTT_OFF
+    _mqttHost.updateValue(doc[_mqttHost.getName()]);
+    _mqttPort.updateValue(doc[_mqttPort.getName()]);
+    #endif
+    _moduleLocation.updateValue(doc[_moduleLocation.getName()]);
+    _moduleName.updateValue(doc[_moduleName.getName()]);
+    #if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
+    serializeJsonPretty(doc, Serial);
+    #endif
+    return true;
+  } else {
+    LOG_ERROR(F("Failed to load json config"), error.c_str());
+    return false;
+  }
+  #else
+  // Avoid using json to reduce build size
+  File configFile = LittleFS.open("/config.json", "r");
+  bool readOK = true;
+  while (readOK && configFile.position() < size) {
+    String line = configFile.readStringUntil('\n');
+    line.trim();
+    int ioc = line.indexOf('=');
+    if (ioc >= 0 && (unsigned int) ioc + 1 < line.length()) {
+      String key = line.substring(0, ioc++);
+      String val = line.substring(ioc, line.length());
+      LOG_DEBUG(F("Read key"), key);
+      LOG_DEBUG(F("Key value"), val);
+      #ifndef MQTT_OFF
+      if (key.equals(_mqttPort.getName())) {
+        _mqttPort.updateValue(val.c_str());
+      } else if (key.equals(_mqttHost.getName())) {
+        _mqttHost.updateValue(val.c_str());
+      } else
+      #endif
+      if (key.equals(_moduleLocation.getName())) {
+        _moduleLocation.updateValue(val.c_str());
+      } else if (key.equals(_moduleName.getName())) {
+        _moduleName.updateValue(val.c_str());
       } else {
-        #ifdef LOGGING
-        debug(F("Config bad format"), line);
-        #endif
+        LOG_WARN(F("Unknown key"));
         readOK = false;
       }
+    } else {
+      LOG_WARN(F("Config bad format"), line);
+      readOK = false;
     }
-    configFile.close();
-    return readOK;
-    #endif
   }
-  return false;
+  configFile.close();
+  return readOK;
+  #endif
 }
 
 /** callback notifying the need to save config */
 void ESPDomotic::saveConfig () {
-  File file = LittleFS.open("/config.json", "w");
+  #ifndef MQTT_OFF
+  _topicPrefixLength = 0;
+  #endif
+  #ifdef USE_BINARY_SETTINGS
+  ConfigRecord record;
+  memset(&record, 0, sizeof(record));
+  copyRecordField(record.moduleLocation, sizeof(record.moduleLocation), _moduleLocation.getValue());
+  copyRecordField(record.moduleName, sizeof(record.moduleName), _moduleName.getValue());
+  #ifndef MQTT_OFF
+  copyRecordField(record.mqttHost, sizeof(record.mqttHost), _mqttHost.getValue());
+  copyRecordField(record.mqttPort, sizeof(record.mqttPort), _mqttPort.getValue());
+  #endif
+  if (writeBinaryRecord("/config.json", _configRecordMagic, &record.header, sizeof(record) - sizeof(record.header))) {
+    LOG_INFO(F("Configuration file saved"));
+  } else {
+    LOG_ERROR(F("Failed to open config file for writing"));
+  }
+  #else
+  char tmpName[_fileNameMaxLength];
+  File file = openAtomicWrite("/config.json", tmpName, sizeof(tmpName));
   if (file) {
     #ifdef USE_JSON
     StaticJsonDocument<200> doc;
@@ -595,8 +1574,8 @@ void ESPDomotic::saveConfig () {
     doc[_moduleLocation.getName()] = _moduleLocation.getValue();
     doc[_moduleName.getName()] = _moduleName.getValue();
     serializeJson(doc, file);
-    #ifdef LOGGING
-    debug(F("Configuration file saved"));
+    LOG_INFO(F("Configuration file saved"));
+    #if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
     serializeJsonPretty(doc, Serial);
     #endif
     #else
@@ -611,12 +1590,13 @@ void ESPDomotic::saveConfig () {
     file.println(line);
     #endif
     #endif
-    file.close();
+    if (!commitAtomicWrite(file, "/config.json", tmpName, !file.getWriteError())) {
+      LOG_ERROR(F("Failed to write config file"));
+    }
   } else {
-    #ifdef LOGGING
-    debug(F("Failed to open config file for writing"));
-    #endif
+    LOG_ERROR(F("Failed to open config file for writing"));
   }
+  #endif
 }
 
 /*
@@ -630,192 +1610,354 @@ void ESPDomotic::saveConfig () {
   Otherwise the size of the file is returned.
 */
 size_t ESPDomotic::getFileSize (const char* fileName) {
-  if (LittleFS.begin()) {
-    if (LittleFS.exists(fileName)) {
-      File file = LittleFS.open(fileName, "r");
-      if (file) {
-        size_t s = file.size();
-        file.close();
-        return s;
-      } else {
-        #ifdef LOGGING
-        debug(F("Cant open file"), fileName);
-        #endif
-      }
+  FileCacheEntry* cached = findCachedFile(fileName);
+  if (cached) {
+    return cached->exists ? cached->size : 0;
+  }
+  if (mountFS()) {
+    File file = LittleFS.open(fileName, "r");
+    if (file) {
+      size_t s = file.size();
+      file.close();
+      cacheFile(fileName, true, s);
+      return s;
     } else {
-      #ifdef LOGGING
-      debug(F("File not found"), fileName);
-      #endif
+      LOG_DEBUG(F("File not found"), fileName);
+      cacheFile(fileName, false, 0);
     }
-  } else {
-    #ifdef LOGGING
-    debug(F("Failed to mount FS"));
-    #endif
   }
   return 0;
 }
 
 void ESPDomotic::loadFile (const char* fileName, char* buff, size_t size) {
-  if (LittleFS.begin()) {
-    if (LittleFS.exists(fileName)) {
-      File file = LittleFS.open(fileName, "r");
-      if (file) {
-        file.readBytes(buff, size);
-        file.close();
-      } else {
-        file.close();
-        #ifdef LOGGING
-        debug(F("Cant open file"), fileName);
-        #endif
-      }
-    } else {
-      #ifdef LOGGING
-      debug(F("File not found"), fileName);
-      #endif
+  readFile(fileName, buff, size);
+}
+
+size_t ESPDomotic::readFile (const char* fileName, char* buff, size_t size) {
+  FileCacheEntry* cached = findCachedFile(fileName);
+  if ((cached && !cached->exists) || !mountFS()) {
+    return 0;
+  }
+  File file = LittleFS.open(fileName, "r");
+  if (!file) {
+    LOG_DEBUG(F("File not found"), fileName);
+    cacheFile(fileName, false, 0);
+    return 0;
+  }
+  size_t length = file.readBytes(buff, size);
+  if (!cached) {
+    cacheFile(fileName, true, file.size());
+  }
+  file.close();
+  return length;
+}
+
+bool ESPDomotic::mountFS () {
+  if (!_fsMounted) {
+    _fsMounted = LittleFS.begin();
+    if (!_fsMounted) {
+      LOG_ERROR(F("Failed to mount FS"));
     }
-  } else {
-    #ifdef LOGGING
-    debug(F("Failed to mount FS"));
-    #endif
   }
+  return _fsMounted;
 }
 
 bool ESPDomotic::updateConf(const char* key, char* value) {
-  File file = LittleFS.open(key, "w");
-  #ifdef LOGGING
-  debug("Updating conf with size", strlen(value));
-  #endif
-  if (file) {
-    file.print(value);
-    file.close();
-    return true; 
+  LOG_DEBUG(F("Updating conf with size"), strlen(value));
+  if (!openConfStore() || !_confStore.put(key, value, strlen(value))) {
+    return false;
   }
-  return false;
+  // A value stored in its own file by a previous firmware would otherwise be migrated over this one
+  if (getFileSize(key) > 0 && !isModuleFile(key)) {
+    LittleFS.remove(key);
+    invalidateCachedFile(key);
+  }
+  return true;
 }
 
 char* ESPDomotic::getConf(const char* key) {
-  size_t size = getFileSize(key);
-  #ifdef LOGGING
-  debug("Getting conf with size", size);
-  #endif
-  if (size > 0) {
-    char* file = new char[size + 1];
-    loadFile(key, file, size);
-    file[size] = '\0'; // workaround para evitar cargar basura desde el fs.
-    return file;
+  LOG_DEBUG(F("Getting conf"), key);
+  if (!openConfStore()) {
+    return NULL;
   }
-  return NULL;
+  char* value = _confStore.copy(key);
+  if (!value && migrateLegacyConf(key)) {
+    value = _confStore.copy(key);
+  }
+  return value;
+}
+
+size_t ESPDomotic::getConf(const char* key, char* buff, size_t size) {
+  if (size == 0 || !openConfStore()) {
+    return 0;
+  }
+  int length = _confStore.get(key, buff, size - 1);
+  if (length < 0 && migrateLegacyConf(key)) {
+    length = _confStore.get(key, buff, size - 1);
+  }
+  length = length < 0 ? 0 : length;
+  buff[length] = '\0';
+  return length;
+}
+
+bool ESPDomotic::openConfStore() {
+  if (!_confStore.isReady() && mountFS()) {
+    _confStore.begin("/conf.kv");
+  }
+  return _confStore.isReady();
+}
+
+bool ESPDomotic::migrateLegacyConf(const char* key) {
+  // Previous firmwares kept each conf value in a file named after its key
+  size_t size = isModuleFile(key) ? 0 : getFileSize(key);
+  if (size == 0) {
+    return false;
+  }
+  char* value = new char[size];
+  bool migrated = readFile(key, value, size) == size && _confStore.put(key, value, size);
+  delete[] value;
+  if (migrated) {
+    LOG_INFO(F("Migrated conf to store"), key);
+    LittleFS.remove(key);
+    invalidateCachedFile(key);
+  }
+  return migrated;
 }
 
 bool ESPDomotic::loadChannelsSettings () {
   if (_channelsCount > 0) {
     size_t size = getFileSize("/settings.json");
     if (size > 0) {
-      #ifdef USE_JSON
-      char buff[size];
-      loadFile("/settings.json", buff, size);
-      StaticJsonDocument<384> doc;
-      DeserializationError error = deserializeJson(doc, buff);
-      #ifdef LOGGING
-      serializeJsonPretty(doc, Serial);
-      #endif
-      if (!error) {
-        for (uint8_t i = 0; i < _channelsCount; ++i) {
-          _channels[i]->updateName(doc[String(_channels[i]->id) + "_n"]);
-          _channels[i]->timer = doc[String(_channels[i]->id) + "_t"];
-          _channels[i]->enabled = doc[String(_channels[i]->id) + "_e"];
-        }
-        return true;
-      } else {
-        #ifdef LOGGING
-        debug(F("Failed to load json"), error.c_str());
-        #endif
-        return false;
-      }
-      #else
-      // Avoid using json to reduce build size
-      File configFile = LittleFS.open("/settings.json", "r");
-      bool readOK = true;
-      while (readOK && configFile.position() < size) {
-        String line = configFile.readStringUntil('\n');
-        line.trim();
-        size_t ioc = line.indexOf('=');
-        if (ioc >= 0 && ioc + 1 < line.length()) {
-          String key = line.substring(0, ioc++);
-          String val = line.substring(ioc, line.length());
-          #ifdef LOGGING
-          debug(F("Read key"), key);
-          debug(F("Key value"), val);
-          #endif
-          for (uint8_t i = 0; i < _channelsCount; ++i) {
-            if (key.startsWith(String(_channels[i]->id) + "_")) {
-              if (key.endsWith("_n")) {
-                _channels[i]->updateName(val.c_str());
-              } else if (key.endsWith("_t")) {
-                _channels[i]->timer = val.toInt();
-              } else if (key.endsWith("_e")) {
-                _channels[i]->enabled = val.equals("1");
+      #ifdef USE_BINARY_SETTINGS
+      SettingsRecord record;
+      switch (readBinaryRecord("/settings.json", size, _settingsRecordMagic, &record.header, sizeof(record))) {
+        case RECORD_OK: {
+          bool v1 = record.header.version == 1;
+          size_t stride = v1 ? sizeof(ChannelRecordV1) : sizeof(ChannelRecord);
+          for (uint8_t r = 0; r < record.header.length / stride; ++r) {
+            ChannelRecord channelRecord;
+            const uint8_t* at = (const uint8_t*) record.channels + r * stride;
+            if (v1) {
+              ChannelRecordV1 old;
+              memcpy(&old, at, sizeof(old));
+              memcpy(channelRecord.id, old.id, sizeof(channelRecord.id));
+              memcpy(channelRecord.name, old.name, sizeof(channelRecord.name));
+              channelRecord.enabled = old.enabled;
+              channelRecord.timer = old.timer;
+            } else {
+              memcpy(&channelRecord, at, sizeof(channelRecord));
+            }
+            channelRecord.id[sizeof(channelRecord.id) - 1] = '\0';
+            channelRecord.name[sizeof(channelRecord.name) - 1] = '\0';
+            for (uint8_t i = 0; i < _channelsCount; ++i) {
+              if (strncmp(channelRecord.id, _channels[i]->id, sizeof(channelRecord.id) - 1) == 0) {
+                _channels[i]->updateName(channelRecord.name);
+                _channels[i]->timer = channelRecord.timer;
+                _channels[i]->enabled = channelRecord.enabled;
+                // Version 1 did not keep it, the channel starts as the sketch declares it
+                if (_persistChannelsState && !v1) {
+                  _channels[i]->state = channelRecord.state;
+                }
               }
-            } 
+            }
           }
-        } else {
-          #ifdef LOGGING
-          debug(F("Config bad format"), line);
-          #endif
-          readOK = false;
+          if (v1) {
+            // Rewritten in the current version
+            scheduleChannelsSettingsSave();
+          }
+          return true;
         }
+        case RECORD_NOT_BINARY:
+          // Written by a firmware using the text format, migrate it
+          if (loadTextChannelsSettings(size)) {
+            scheduleChannelsSettingsSave();
+            return true;
+          }
+          return false;
+        default:
+          LOG_ERROR(F("Corrupt channels settings record"));
+          return false;
       }
-      configFile.close();
-      return readOK;
+      #else
+      return loadTextChannelsSettings(size);
       #endif
     }
     return false;
   } else {
-    #ifdef LOGGING
-    debug(F("No channel configured"));
-    #endif
+    LOG_INFO(F("No channel configured"));
     return false;
   }
 }
 
-void ESPDomotic::saveChannelsSettings () {
-  File file = LittleFS.open("/settings.json", "w");
-  if (file) {
-    #ifdef USE_JSON
-    //TODO Trim param values
-    StaticJsonDocument<384> doc;
+bool ESPDomotic::loadTextChannelsSettings (size_t size) {
+  #ifdef USE_JSON
+  char buff[size];
+  loadFile("/settings.json", buff, size);
+  DynamicJsonDocument doc(_settingsJsonCapacity);
+  // A document that does not fit fails with NoMemory
+  DeserializationError error = deserializeJson(doc, buff, size);
+  #if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
+  serializeJsonPretty(doc, Serial);
+  #endif
+  if (!error) {
     for (uint8_t i = 0; i < _channelsCount; ++i) {
-      doc[String(_channels[i]->id) + "_n"] = _channels[i]->name;
-      doc[String(_channels[i]->id) + "_t"] = _channels[i]->timer;
-      doc[String(_channels[i]->id) + "_e"] = _channels[i]->enabled;
-    }
-    serializeJson(doc, file);
-    #ifdef LOGGING
-    debug(F("Configuration file saved"));
-    serializeJsonPretty(doc, Serial);
-    #endif
-    #else
-    for (uint8_t i = 0; i > _channelsCount; ++i) {
-      String line = String(_channels[i]->id) + "_n=" + String(_channels[i]->name);
-      file.println(line);
-      line = String(_channels[i]->id) + "_t=" + String(_channels[i]->timer);
-      file.println(line);
-      line = String(_channels[i]->id) + "_e=" + String(_channels[i]->enabled);
-      file.println(line);
+      _channels[i]->updateName(doc[String(_channels[i]->id) + "_n"]);
+      _channels[i]->timer = doc[String(_channels[i]->id) + "_t"];
+      _channels[i]->enabled = doc[String(_channels[i]->id) + "_e"];
+      if (_persistChannelsState && doc.containsKey(String(_channels[i]->id) + "_s")) {
+        _channels[i]->state = doc[String(_channels[i]->id) + "_s"];
+      }
     }
-    #endif
-    file.close();
+    return true;
   } else {
-    #ifdef LOGGING
-    debug(F("Failed to open config file for writing"));
-    #endif
+    LOG_ERROR(F("Failed to load json"), error.c_str());
+    return false;
+  }
+  #else
+  // Avoid using json to reduce build size
+  File configFile = LittleFS.open("/settings.json", "r");
+  bool readOK = true;
+  while (readOK && configFile.position() < size) {
+    String line = configFile.readStringUntil('\n');
+    line.trim();
+    int ioc = line.indexOf('=');
+    if (ioc >= 0 && (unsigned int) ioc + 1 < line.length()) {
+      String key = line.substring(0, ioc++);
+      String val = line.substring(ioc, line.length());
+      LOG_DEBUG(F("Read key"), key);
+      LOG_DEBUG(F("Key value"), val);
+      for (uint8_t i = 0; i < _channelsCount; ++i) {
+        if (key.startsWith(String(_channels[i]->id) + "_")) {
+          if (key.endsWith("_n")) {
+            _channels[i]->updateName(val.c_str());
+          } else if (key.endsWith("_t")) {
+            _channels[i]->timer = val.toInt();
+          } else if (key.endsWith("_e")) {
+            _channels[i]->enabled = val.equals("1");
+          } else if (key.endsWith("_s") && _persistChannelsState) {
+            _channels[i]->state = val.toInt();
+          }
+        } 
+      }
+    } else {
+      LOG_WARN(F("Config bad format"), line);
+      readOK = false;
+    }
+  }
+  configFile.close();
+  return readOK;
+  #endif
+}
+
+void ESPDomotic::scheduleChannelsSettingsSave () {
+  if (!_settingsDirty) {
+    // The window starts with the first change, so a stream of changes can't postpone the save forever
+    _settingsDirty = true;
+    _settingsSaveAt = millis() + _settingsCommitDelay;
+  }
+}
+
+void ESPDomotic::flushChannelsSettings () {
+  if (_settingsDirty) {
+    saveChannelsSettings();
+  }
+}
+
+bool ESPDomotic::saveChannelsSettings () {
+  if (!writeChannelsSettings()) {
+    // Kept as changed, so the save is tried again once another window is over
+    _settingsDirty = true;
+    _settingsSaveAt = millis() + _settingsCommitDelay;
+    return false;
+  }
+  _settingsDirty = false;
+  #ifdef METRICS
+  ++_metrics.flashWrites;
+  #endif
+  return true;
+}
+
+bool ESPDomotic::writeChannelsSettings () {
+  #ifdef USE_BINARY_SETTINGS
+  SettingsRecord record;
+  memset(&record, 0, sizeof(record));
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    ChannelRecord& channelRecord = record.channels[i];
+    copyRecordField(channelRecord.id, sizeof(channelRecord.id), _channels[i]->id);
+    copyRecordField(channelRecord.name, sizeof(channelRecord.name), _channels[i]->name);
+    channelRecord.timer = _channels[i]->timer;
+    channelRecord.enabled = _channels[i]->enabled;
+    channelRecord.state = _channels[i]->state;
+  }
+  if (writeBinaryRecord("/settings.json", _settingsRecordMagic, &record.header, _channelsCount * sizeof(ChannelRecord))) {
+    LOG_INFO(F("Configuration file saved"));
+    return true;
+  }
+  LOG_ERROR(F("Failed to open config file for writing"));
+  return false;
+  #else
+  char tmpName[_fileNameMaxLength];
+  File file = openAtomicWrite("/settings.json", tmpName, sizeof(tmpName));
+  if (!file) {
+    LOG_ERROR(F("Failed to open config file for writing"));
+    return false;
+  }
+  #ifdef USE_JSON
+  //TODO Trim param values
+  DynamicJsonDocument doc(_settingsJsonCapacity);
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    doc[String(_channels[i]->id) + "_n"] = _channels[i]->name;
+    doc[String(_channels[i]->id) + "_t"] = _channels[i]->timer;
+    doc[String(_channels[i]->id) + "_e"] = _channels[i]->enabled;
+    doc[String(_channels[i]->id) + "_s"] = _channels[i]->state;
+  }
+  if (doc.overflowed()) {
+    // A partial document would lose the settings of the channels left out, the previous file is kept
+    LOG_ERROR(F("Channels settings do not fit the json document"));
+    commitAtomicWrite(file, "/settings.json", tmpName, false);
+    return false;
+  }
+  serializeJson(doc, file);
+  LOG_INFO(F("Configuration file saved"));
+  #if DOMOTIC_LOG_LEVEL >= DOMOTIC_LOG_LEVEL_DEBUG
+  serializeJsonPretty(doc, Serial);
+  #endif
+  #else
+  for (uint8_t i = 0; i < _channelsCount; ++i) {
+    String line = String(_channels[i]->id) + "_n=" + String(_channels[i]->name);
+    file.println(line);
+    line = String(_channels[i]->id) + "_t=" + String(_channels[i]->timer);
+    file.println(line);
+    line = String(_channels[i]->id) + "_e=" + String(_channels[i]->enabled);
+    file.println(line);
+    line = String(_channels[i]->id) + "_s=" + String(_channels[i]->state);
+    file.println(line);
+  }
+  #endif
+  if (!commitAtomicWrite(file, "/settings.json", tmpName, !file.getWriteError())) {
+    LOG_ERROR(F("Failed to write channels settings file"));
+    return false;
   }
+  return true;
+  #endif
 }
 
 void ESPDomotic::setWifiConnectTimeout (uint16_t seconds) {
   _wifiConnectTimeout = seconds;
 }
 
+void ESPDomotic::setWifiRetryInterval (uint16_t seconds) {
+  _wifiRetryInterval = seconds;
+}
+
+void ESPDomotic::setConnectivityCallback (std::function<void(ConnectivityState)> callback) {
+  _connectivityCallback = callback;
+}
+
+ConnectivityState ESPDomotic::getConnectivityState () {
+  return _connectivityState;
+}
+
 void ESPDomotic::setConfigPortalTimeout (uint16_t seconds) {
   _configPortalTimeout = seconds;
 }
@@ -824,33 +1966,59 @@ void ESPDomotic::setConfigFileSize (uint16_t bytes) {
   _configFileSize = bytes;
 }
 
+void ESPDomotic::setPersistChannelsState (bool persist) {
+  _persistChannelsState = persist;
+}
+
+unsigned long ESPDomotic::getOutputsReadyMillis () {
+  return _outputsReadyMillis;
+}
+
+void ESPDomotic::setSettingsCommitDelay (uint16_t commitDelay) {
+  _settingsCommitDelay = commitDelay;
+}
+
 #ifdef LOGGING
-template <class T> void ESPDomotic::debug (T text) {
-  Serial.print("*DOMO: ");
+template <class T> void ESPDomotic::logMessage (LogLevel level, T text) {
+  Serial.print(F("*DOMO "));
+  Serial.print(_logLevelCodes[level <= DOMOTIC_LOG_LEVEL_DEBUG ? level : 0]);
+  Serial.print(F(": "));
   Serial.println(text);
   #ifdef MQTT_LOG
-  #ifndef MQTT_OFF
-  if (_mqttClient.connected()) {
-    String s = String(ESP.getChipId()) + ": " + String(text);
-    _mqttClient.publish("/domotic/log", s.c_str());
+  if (level <= _mqtt_log_level) {
+    char buff[_logLineMaxLength];
+    BufferPrint line(buff, sizeof(buff));
+    line.print(text);
+    queueLog(level, buff, line.kept());
   }
   #endif
-  #endif
 }
 
-template <class T, class U> void ESPDomotic::debug (T key, U value) {
-  Serial.print("*DOMO: ");
+template <class T, class U> void ESPDomotic::logMessage (LogLevel level, T key, U value) {
+  Serial.print(F("*DOMO "));
+  Serial.print(_logLevelCodes[level <= DOMOTIC_LOG_LEVEL_DEBUG ? level : 0]);
+  Serial.print(F(": "));
   Serial.print(key);
-  Serial.print(": ");
+  Serial.print(F(": "));
   Serial.println(value);
   #ifdef MQTT_LOG
-  #ifndef MQTT_OFF
-  if (_mqttClient.connected()) {
-    String s = String(ESP.getChipId()) + ": " + String(key) + " " + String(value);
-    _mqttClient.publish("/domotic/log", s.c_str());
+  if (level <= _mqtt_log_level) {
+    char buff[_logLineMaxLength];
+    BufferPrint line(buff, sizeof(buff));
+    line.print(key);
+    line.print(F(": "));
+    line.print(value);
+    queueLog(level, buff, line.kept());
   }
   #endif
-  #endif
+}
+
+template <class T> void ESPDomotic::debug (T text) {
+  logMessage(DOMOTIC_LOG_LEVEL_DEBUG, text);
+}
+
+template <class T, class U> void ESPDomotic::debug (T key, U value) {
+  logMessage(DOMOTIC_LOG_LEVEL_DEBUG, key, value);
 }
 #endif
 
@@ -868,23 +2036,320 @@ void Channel::init(const char* id, const char* name, uint8_t pin, uint8_t pinMod
   this->state = state;
   this->timer = timer;
   this->enabled = true;
+  this->locallyChanged = false;
+  this->debounce = _inputDefaultDebounceMillis;
+  this->boundOutput = NULL;
+  this->timerControl = 0;
   this->pinMode = pinMode;
   this->name = new char[_channelNameMaxLength + 1];
   updateName(name);
 }
 
 void Channel::updateName (const char *v) {
-  String(v).toCharArray(this->name, _channelNameMaxLength);
+  // Longer names are cut to fit
+  snprintf(this->name, _channelNameMaxLength, "%.*s", _channelNameMaxLength - 1, v ? v : "");
 }
 
 void Channel::updateTimerControl() {
+  // Deadlines are compared as signed differences, so longer timers can't be told apart from expired ones
+  if (this->timer > (unsigned long) INT32_MAX) {
+    this->timerControl = 0;
+    return;
+  }
   this->timerControl = millis() + this->timer;
+  if (this->timerControl == 0) {
+    // 0 is reserved to tell that there is no timer running
+    this->timerControl = 1;
+  }
 }
 
 bool Channel::timeIsUp() {
-  return this->timerControl > 0 && millis() > this->timerControl;
+  return timeIsUp(millis());
+}
+
+bool Channel::timeIsUp(unsigned long now) {
+  return this->timerControl != 0 && deadlineReached(now, this->timerControl);
 }
 
 bool Channel::isEnabled () {
   return this->enabled && this->name != NULL && strlen(this->name) > 0;
-}
\ No newline at end of file
+}
+
+
+
+uint16_t ConfStore::hashKey(const char* key, size_t length) {
+  // 0 is reserved for empty slots
+  uint16_t hash = fnv1a16(key, length);
+  return hash ? hash : 1;
+}
+
+void ConfStore::begin(const char* fileName) {
+  _fileName = fileName;
+  memset(_index, 0, sizeof(_index));
+  _count = 0;
+  _size = 0;
+  _garbage = 0;
+  _torn = false;
+  File file = LittleFS.open(fileName, "r");
+  if (!file) {
+    // Nothing stored yet
+    return;
+  }
+  size_t fileSize = file.size();
+  uint8_t header[_confRecordHeaderLength];
+  char key[_confKeyMaxLength + 1];
+  while (_size + _confRecordHeaderLength <= fileSize) {
+    file.seek(_size, SeekSet);
+    if (file.read(header, sizeof(header)) != sizeof(header)) {
+      break;
+    }
+    uint8_t keyLength = header[0];
+    uint16_t length = header[1] | (header[2] << 8);
+    uint32_t recordSize = _confRecordHeaderLength + keyLength + length;
+    if (keyLength == 0 || keyLength > _confKeyMaxLength || _size + recordSize > fileSize || _size > 0xFFFF
+        || file.read((uint8_t*) key, keyLength) != keyLength) {
+      break;
+    }
+    key[keyLength] = '\0';
+    index(file, key, keyLength, _size, length);
+    _size += recordSize;
+  }
+  _torn = _size < fileSize;
+  file.close();
+}
+
+bool ConfStore::isReady() {
+  return _fileName != NULL;
+}
+
+ConfStore::Entry* ConfStore::find(File& file, const char* key, size_t keyLength, uint16_t hash) {
+  char stored[_confKeyMaxLength];
+  for (uint8_t probe = 0, i = hash % _confIndexSize; probe < _confIndexSize; ++probe, i = (i + 1) % _confIndexSize) {
+    Entry& entry = _index[i];
+    if (entry.hash == 0) {
+      return NULL;
+    }
+    // Hashes may collide, the key stored in the record settles it
+    if (entry.hash == hash && entry.keyLength == keyLength && file.seek(entry.offset + _confRecordHeaderLength, SeekSet)
+        && file.read((uint8_t*) stored, keyLength) == keyLength && memcmp(stored, key, keyLength) == 0) {
+      return &entry;
+    }
+  }
+  return NULL;
+}
+
+bool ConfStore::index(File& file, const char* key, uint8_t keyLength, uint16_t offset, uint16_t length) {
+  uint16_t hash = hashKey(key, keyLength);
+  Entry* entry = find(file, key, keyLength, hash);
+  if (entry) {
+    _garbage += _confRecordHeaderLength + entry->keyLength + entry->length;
+  } else if (_count < MAX_CONF_KEYS) {
+    entry = insert(hash, keyLength);
+  } else {
+    return false;
+  }
+  entry->offset = offset;
+  entry->length = length;
+  return true;
+}
+
+ConfStore::Entry* ConfStore::insert(uint16_t hash, uint8_t keyLength) {
+  uint8_t i = hash % _confIndexSize;
+  while (_index[i].hash != 0) {
+    i = (i + 1) % _confIndexSize;
+  }
+  _index[i].hash = hash;
+  _index[i].keyLength = keyLength;
+  ++_count;
+  return &_index[i];
+}
+
+int ConfStore::get(const char* key, char* buff, size_t size) {
+  if (!isReady()) {
+    return -1;
+  }
+  File file = LittleFS.open(_fileName, "r");
+  if (!file) {
+    return -1;
+  }
+  size_t keyLength = strlen(key);
+  int length = -1;
+  Entry* entry = find(file, key, keyLength, hashKey(key, keyLength));
+  if (entry) {
+    // find leaves the file right after the key, where the value starts
+    length = file.read((uint8_t*) buff, entry->length < size ? entry->length : size);
+  }
+  file.close();
+  return length;
+}
+
+char* ConfStore::copy(const char* key) {
+  if (!isReady()) {
+    return NULL;
+  }
+  File file = LittleFS.open(_fileName, "r");
+  if (!file) {
+    return NULL;
+  }
+  size_t keyLength = strlen(key);
+  char* value = NULL;
+  // Sized and read through a single open
+  Entry* entry = find(file, key, keyLength, hashKey(key, keyLength));
+  if (entry && entry->length > 0) {
+    value = new char[entry->length + 1];
+    if (file.read((uint8_t*) value, entry->length) == entry->length) {
+      value[entry->length] = '\0';
+    } else {
+      delete[] value;
+      value = NULL;
+    }
+  }
+  file.close();
+  return value;
+}
+
+bool ConfStore::put(const char* key, const char* value, size_t length) {
+  size_t keyLength = strlen(key);
+  uint32_t recordSize = _confRecordHeaderLength + keyLength + length;
+  if (!isReady() || keyLength == 0 || keyLength > _confKeyMaxLength || length > 0xFFFF) {
+    return false;
+  }
+  // Appending after a torn record would leave it in the middle of the file
+  if (_torn && !compact()) {
+    return false;
+  }
+  // Records offsets are 16 bits, the overwritten ones are reclaimed before giving up
+  if (_size + recordSize > 0xFFFF && (_garbage == 0 || !compact() || _size + recordSize > 0xFFFF)) {
+    return false;
+  }
+  File file = LittleFS.open(_fileName, "a+");
+  if (!file) {
+    return false;
+  }
+  uint16_t hash = hashKey(key, keyLength);
+  Entry* entry = find(file, key, keyLength, hash);
+  if (!entry && _count >= MAX_CONF_KEYS) {
+    // Checked before appending, a record left out of the index would never be read nor reclaimed
+    file.close();
+    return false;
+  }
+  uint8_t header[_confRecordHeaderLength] = { (uint8_t) keyLength, (uint8_t) (length & 0xFF), (uint8_t) (length >> 8) };
+  bool written = file.write(header, sizeof(header)) == sizeof(header)
+      && file.write((const uint8_t*) key, keyLength) == keyLength
+      && file.write((const uint8_t*) value, length) == length;
+  if (written) {
+    file.flush();
+    if (entry) {
+      _garbage += _confRecordHeaderLength + entry->keyLength + entry->length;
+    } else {
+      entry = insert(hash, keyLength);
+    }
+    entry->offset = _size;
+    entry->length = length;
+    _size += recordSize;
+  } else {
+    _torn = true;
+  }
+  file.close();
+  return written;
+}
+
+bool ConfStore::needsCompaction() {
+  return _torn || (_garbage > _confCompactThreshold && _garbage > _size / 2);
+}
+
+bool ConfStore::compact() {
+  if (!isReady()) {
+    return false;
+  }
+  File src = LittleFS.open(_fileName, "r");
+  char tmpName[_fileNameMaxLength];
+  File dst = openAtomicWrite(_fileName, tmpName, sizeof(tmpName));
+  if (!dst) {
+    src.close();
+    return false;
+  }
+  uint16_t offsets[_confIndexSize];
+  uint32_t size = 0;
+  uint8_t chunk[32];
+  bool written = true;
+  for (uint8_t i = 0; written && i < _confIndexSize; ++i) {
+    Entry& entry = _index[i];
+    if (entry.hash == 0) {
+      continue;
+    }
+    size_t remaining = _confRecordHeaderLength + entry.keyLength + entry.length;
+    offsets[i] = size;
+    size += remaining;
+    written = src && src.seek(entry.offset, SeekSet);
+    while (written && remaining > 0) {
+      size_t n = remaining < sizeof(chunk) ? remaining : sizeof(chunk);
+      written = src.read(chunk, n) == n && dst.write(chunk, n) == n;
+      remaining -= n;
+    }
+  }
+  if (src) {
+    src.close();
+  }
+  if (!commitAtomicWrite(dst, _fileName, tmpName, written)) {
+    return false;
+  }
+  for (uint8_t i = 0; i < _confIndexSize; ++i) {
+    if (_index[i].hash != 0) {
+      _index[i].offset = offsets[i];
+    }
+  }
+  _size = size;
+  _garbage = 0;
+  _torn = false;
+  return true;
+}
+
+#ifndef MQTT_OFF
+PubSubTransport::PubSubTransport(PubSubClient& client) : _client(client) {
+}
+
+bool PubSubTransport::connect(const char* clientId, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) {
+  return _client.connect(clientId, NULL, NULL, willTopic, willQos, willRetain, willMessage, cleanSession);
+}
+
+bool PubSubTransport::connected() {
+  return _client.connected();
+}
+
+int PubSubTransport::state() {
+  return _client.state();
+}
+
+bool PubSubTransport::loop() {
+  return _client.loop();
+}
+
+bool PubSubTransport::subscribe(const char* topic, uint8_t qos) {
+  return _client.subscribe(topic, qos);
+}
+
+bool PubSubTransport::unsubscribe(const char* topic) {
+  return _client.unsubscribe(topic);
+}
+
+bool PubSubTransport::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  return _client.publish(topic, payload, length, retained);
+}
+
+bool PubSubTransport::beginPublish(const char* topic, unsigned int length, bool retained) {
+  return _client.beginPublish(topic, length, retained);
+}
+
+size_t PubSubTransport::write(const uint8_t* data, size_t length) {
+  return _client.write(data, length);
+}
+
+bool PubSubTransport::endPublish() {
+  return _client.endPublish() == 1;
+}
+
+void PubSubTransport::setCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) {
+  _client.setCallback(callback);
+}
+#endif
@@ -7,30 +7,90 @@
 #include <PubSubClient.h>
 #endif
 #include <ESP8266WebServer.h>
+#include <ESPDomoticCore.h>
 
 const uint8_t       _invalidPinNo                 = 255;
 
-#ifndef MAX_CHANNELS
-#define MAX_CHANNELS 4
-#endif
-
 #ifndef MQTT_OFF
     #ifdef MQTT_RECONNECTION_RETRY_WAIT_MILLIS
     const unsigned long _mqtt_reconnection_retry_wait_millis    = MQTT_RECONNECTION_RETRY_WAIT_MILLIS;
     #else
     const unsigned long _mqtt_reconnection_retry_wait_millis    = 10 * 1000;
     #endif
+    #ifdef MQTT_RECONNECTION_MAX_WAIT_MILLIS
+    const unsigned long _mqtt_reconnection_max_wait_millis  = MQTT_RECONNECTION_MAX_WAIT_MILLIS;
+    #else
+    const unsigned long _mqtt_reconnection_max_wait_millis  = 5 * 60 * 1000;
+    #endif
+    // Once reached, the module rests for the max wait and starts retrying again
     #ifdef MQTT_RECONNECTION_MAX_RETRIES
     const unsigned long _mqtt_reconnection_max_retries    = MQTT_RECONNECTION_MAX_RETRIES;
     #else
     const unsigned long _mqtt_reconnection_max_retries    = 1000;
     #endif
+    // Bounds the time a single connection attempt can block the loop
+    #ifdef MQTT_CONNECT_TIMEOUT_MILLIS
+    const unsigned long _mqtt_connect_timeout_millis      = MQTT_CONNECT_TIMEOUT_MILLIS;
+    #else
+    const unsigned long _mqtt_connect_timeout_millis      = 2000;
+    #endif
+    // QoS of the commands subscriptions
+    const uint8_t       _mqtt_subscription_qos            = 1;
+#endif
+// Metrics are published through mqtt
+#if defined(METRICS) && defined(MQTT_OFF)
+#undef METRICS
+#endif
+/*
+Logging. DOMOTIC_LOG_LEVEL sets the least severe level logged (LOGGING alone logs them all).
+The log calls of the levels under it compile to nothing, arguments included.
+*/
+#ifndef DOMOTIC_LOG_LEVEL
+    #ifdef LOGGING
+    #define DOMOTIC_LOG_LEVEL DOMOTIC_LOG_LEVEL_DEBUG
+    #else
+    #define DOMOTIC_LOG_LEVEL DOMOTIC_LOG_LEVEL_NONE
+    #endif
+#endif
+#if DOMOTIC_LOG_LEVEL > DOMOTIC_LOG_LEVEL_NONE && !defined(LOGGING)
+#define LOGGING
+#endif
+
+// Log lines are published through mqtt
+#if defined(MQTT_LOG) && (defined(MQTT_OFF) || !defined(LOGGING))
+#undef MQTT_LOG
+#endif
+#ifdef MQTT_LOG
+    // Less severe lines are not published (but still printed)
+    #ifdef MQTT_LOG_LEVEL
+    const LogLevel      _mqtt_log_level                 = MQTT_LOG_LEVEL;
+    #else
+    const LogLevel      _mqtt_log_level                 = DOMOTIC_LOG_LEVEL;
+    #endif
+    // Bytes of log lines published on each drain, drains are done at most once per period
+    #ifdef MQTT_LOG_BUDGET
+    const size_t        _mqtt_log_budget                = MQTT_LOG_BUDGET;
+    #else
+    const size_t        _mqtt_log_budget                = 256;
+    #endif
+    const unsigned long _mqtt_log_drain_period_millis   = 100;
+#endif
+#ifdef METRICS
+    #ifdef METRICS_PERIOD_MILLIS
+    const unsigned long _metrics_period_millis          = METRICS_PERIOD_MILLIS;
+    #else
+    const unsigned long _metrics_period_millis          = 60 * 1000;
+    #endif
 #endif
 const uint8_t       _wifiMinSignalQuality           = 30;
 const uint8_t       _channelNameMaxLength           = 20;
 const uint8_t       _paramValueMaxLength            = 20;
 const uint8_t       _paramIPValueLength             = 16;   // IP max length is 15 chars
 const uint8_t       _paramPortValueLength           = 6;    // port range is from 0 to 65535
+const uint8_t       _fileNameMaxLength              = 32;   // LittleFS max file name length (31 chars)
+const uint8_t       _topicPrefixMaxLength           = _paramValueMaxLength * 3 + 4;
+const uint8_t       _topicMaxLength                 = _topicPrefixMaxLength + _channelNameMaxLength + 24;
+const uint16_t      _inputDefaultDebounceMillis     = 50;
 
 class Channel {
     public:
@@ -45,6 +105,10 @@ class Channel {
         unsigned long   timer;
         bool            enabled;
         bool            locallyChanged;
+        // Input channels. Millis the pin must be stable for a change to be taken.
+        uint16_t        debounce;
+        // Input channels. Output channel toggled on each change of the input.
+        Channel*        boundOutput;
 
         unsigned long   timerControl;
         
@@ -52,14 +116,49 @@ class Channel {
 
         // Updates the channel´s name
         void    updateName (const char *v);
-        // Updates the timer control setting it to timer time ftom now
+        // Updates the timer control setting it to timer time ftom now. A timer of -1 means the channel has no timer.
         void    updateTimerControl();
 
+        // Tells if the timer control deadline has been reached. Safe across millis() overflow.
         bool    timeIsUp();
+        bool    timeIsUp(unsigned long now);
 
         bool    isEnabled();
 };
 
+// Wifi connectivity states, reported through the connectivity callback
+enum ConnectivityState {
+    CONNECTIVITY_CONNECTING,
+    CONNECTIVITY_CONNECTED,
+    CONNECTIVITY_PORTAL,
+    CONNECTIVITY_STANDALONE
+};
+
+#ifndef MQTT_OFF
+// The default transport, through the PubSubClient mqtt client
+class PubSubTransport : public MessageTransport {
+    public:
+        PubSubTransport(PubSubClient& client);
+
+        bool    connect(const char* clientId, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) override;
+        bool    connected() override;
+        int     state() override;
+        bool    loop() override;
+        bool    subscribe(const char* topic, uint8_t qos) override;
+        bool    unsubscribe(const char* topic) override;
+        bool    publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) override;
+        bool    beginPublish(const char* topic, unsigned int length, bool retained) override;
+        size_t  write(const uint8_t* data, size_t length) override;
+        bool    endPublish() override;
+        void    setCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) override;
+
+        using MessageTransport::publish;
+
+    private:
+        PubSubClient&   _client;
+};
+#endif
+
 /*
 Provides this functionality:
 > HTTP update
@@ -79,6 +178,8 @@ class ESPDomotic {
         void    loop();
         // Check channels timers and updates its states
         void    checkChannelsTimers();
+        // Returns the millis at wich the earliest channel timer is due. 0 if no timer is running.
+        unsigned long getNextTimerDeadline();
 
         /* Module settings */
         // Sets the SSID for the configuration portal (When module enters in AP mode)
@@ -100,8 +201,19 @@ class ESPDomotic {
         // REsets the module
         void                moduleSoftReset ();
         void                setWifiConnectTimeout (uint16_t seconds);
+        // Sets how long the module waits, while running stand alone, before trying to connect to wifi again
+        void                setWifiRetryInterval (uint16_t seconds);
+        // Sets the callback called each time the wifi connectivity state changes
+        void                setConnectivityCallback (std::function<void(ConnectivityState)> callback);
+        ConnectivityState   getConnectivityState ();
         void                setConfigPortalTimeout (uint16_t seconds);
         void                setConfigFileSize (uint16_t bytes);
+        // Sets the window (millis) during wich channels settings changes are gathered before being written to flash
+        void                setSettingsCommitDelay (uint16_t commitDelay);
+        // Persists the output channels state, so it is restored on boot. Each state change is written to flash (through the commit delay).
+        void                setPersistChannelsState (bool persist);
+        // Returns the millis since reset at wich the channels pins were driven during init. Useful to measure boot latency.
+        unsigned long       getOutputsReadyMillis ();
 
         #ifndef MQTT_OFF
         /* MQTT */
@@ -109,14 +221,33 @@ class ESPDomotic {
         void                setMqttConnectionCallback(std::function<void()> callback);
         // Sets the callback used to tell that a message was received via mqtt
         void                setMqttMessageCallback(std::function<void(char*, uint8_t*, unsigned int)> callback);
+        /*
+            Keeps the mqtt session in the broker between connections (clean session off), so the commands (QoS1) sent
+            while the module is offline are delivered once it reconnects.
+        */
+        void                setMqttPersistentSession(bool persistent);
+        /*
+            Subscribes to every station and channel command with just two wildcard subscriptions (instead of one per channel)
+            and routes them locally, so renaming a channel needs no broker traffic.
+        */
+        void                setMqttCollapsedSubscriptions(bool collapsed);
+        // Returns the millis the last broker connection took, subscriptions included
+        unsigned long       getMqttConnectMillis();
         // Returns the mqtt host the user configured
         const char*         getMqttServerHost();
         // Returns the mqtt port the user configured
         uint16_t            getMqttServerPort();
         // Returns the inner mqtt client
         PubSubClient*       getMqttClient();
+        // Sets the transport the module messages go through (the mqtt client by default). Must be set before init.
+        void                setTransport(MessageTransport* transport);
+        MessageTransport*   getTransport();
+        // Writes the station topic for the suffix into buff. Returns the topic length.
+        size_t              getStationTopic (const char* suffix, char* buff, size_t size);
+        // Writes the mqtt topic to which a channel may be subscribed into buff. Returns the topic length.
+        size_t              getChannelTopic (Channel *c, const char* suffix, char* buff, size_t size);
+        // Kept for compatibility, prefer the buffer overloads as these allocate
         String              getStationTopic (String cmd);
-        // Returns the mqtt topic to which a channel may be subscribed
         String              getChannelTopic (Channel *c, String cmd);
         #endif
 
@@ -124,39 +255,64 @@ class ESPDomotic {
         ESP8266WebServer*   getHttpServer();
 
         /* Channels */
-        // Returns the i'th  channel
+        // Returns the i'th  channel. Null if out of bounds.
         Channel         *getChannel(uint8_t i);
         // Get the quantity of channels configured
         uint8_t         getChannelsCount();
-        // Save the channel settings in FS
-        void            saveChannelsSettings ();
+        // Save the channel settings in FS right away. Returns false if they could not be written, then they are tried again after the commit delay.
+        bool            saveChannelsSettings ();
+        // Marks the channel settings as changed. They are saved once the commit delay is over, gathering later changes.
+        void            scheduleChannelsSettingsSave ();
+        // Saves the channel settings now if there are changes pending to be saved
+        void            flushChannelsSettings ();
         // Updates the state of the channel with the new state
         bool            updateChannelState (Channel* channel, uint8_t state);
-        // Adds new channel to manage
-        void            addChannel(Channel* c);
+        // Publishes the channel feedback. If the broker is unreachable it gets queued and published once reconnected.
+        void            publishChannelFeedback (Channel* channel, ChannelFeedback feedback);
+        // Adds new channel to manage. Returns false if MAX_CHANNELS are already managed.
+        bool            addChannel(Channel* c);
+        /*
+            Binds an input channel to an output one, so each (debounced) change of the input toggles the output locally,
+            as a wall switch does. Returns false if the channels modes do not fit.
+        */
+        bool            bindInputChannel(Channel* input, Channel* output);
+        /*
+            Channel commands. They return true if the channel changed. When given, valid tells whether the payload was
+            accepted, so a command that leaves the channel as it was can be told apart from a rejected one.
+        */
         // To rename a channel
-        bool            renameChannelCommand(Channel* c, uint8_t* payload, unsigned int length);
+        bool            renameChannelCommand(Channel* c, uint8_t* payload, unsigned int length, bool* valid = NULL);
         // To change the state of a channel. Intened to use with channel configures as OUTPUT
-        bool            changeStateCommand(Channel* c, uint8_t* payload, unsigned int length);
+        bool            changeStateCommand(Channel* c, uint8_t* payload, unsigned int length, bool* valid = NULL);
         // To update the timer of a channel
-        bool            updateChannelTimerCommand(Channel* c, uint8_t* payload, unsigned int length);
+        bool            updateChannelTimerCommand(Channel* c, uint8_t* payload, unsigned int length, bool* valid = NULL);
         // To enable/disable a channel
-        bool            enableChannelCommand(Channel* c, unsigned char* payload, unsigned int length);
+        bool            enableChannelCommand(Channel* c, unsigned char* payload, unsigned int length, bool* valid = NULL);
+        // To change the state of several output channels at once. Payload holds a char per channel: '1' on, '0' off, '-' kept.
+        bool            changeStatesCommand(uint8_t* payload, unsigned int length);
 
         /* Utils */
         // Returns the size of a file
         size_t          getFileSize (const char* fileName);
         // Loads a file into the buffer.
         void            loadFile (const char* fileName, char buff[], size_t size);
+        // Reads up to size bytes of a file into the buffer. Returns the bytes read, 0 if the file does not exist.
+        size_t          readFile (const char* fileName, char* buff, size_t size);
         /* 
             Updates the configuration under the specified key. It will create a new one if none.
-            Returns true if the configuration was correctly created.
+            Values are kept in a single log structured file (/conf.kv). Returns true if the configuration was correctly created.
         */
         bool            updateConf(const char* key, char* value);
         // Returns the configuracion value that exists under the specified key. Null if none.
         char*           getConf(const char* key);
+        // Reads the configuration value into buff (null terminated, truncated to size). Returns its length, 0 if none.
+        size_t          getConf(const char* key, char* buff, size_t size);
 
         /* Logging */
+        // Logs the text at the level. The module own calls of the levels under DOMOTIC_LOG_LEVEL are compiled out.
+        template <class T> void             logMessage(LogLevel level, T text);
+        template <class T, class U> void    logMessage(LogLevel level, T key, U value);
+        // Logs at debug level
         template <class T> void             debug(T text);
         template <class T, class U> void    debug(T key, U value);
 
@@ -177,11 +333,68 @@ class ESPDomotic {
         /* Receives the message from the mqtt client */
         void            receiveMqttMessage(char* topic, uint8_t* payload, unsigned int length);
         void            connectBroker();
+        // Sets the time of the next broker connection attempt using exponential backoff with jitter
+        void            scheduleBrokerReconnection();
+        // Publishes the channel feedback right away. Returns false if it could not be published.
+        bool            sendChannelFeedback(Channel* channel, ChannelFeedback feedback);
+        // Publishes the feedback queued while the broker was unreachable
+        void            flushPendingFeedback();
+        // Publishes the retained station snapshot, with every channel id, name, state, enabled flag and timer (seconds, -1 if none)
+        void            publishSnapshot();
+        void            printChannelSnapshot(Print& out, Channel* channel);
+        // Publishes every channel state in a single message. If it can not be published the changed channels feedback gets queued.
+        void            publishStatesFeedback(uint32_t changed);
+        // Rebuilds the table used to dispatch incoming messages to the channels
+        void            buildTopicDispatch();
+        // Caches the immutable type/location/name/ prefix shared by all the module topics
+        void            buildTopicPrefix();
+        #endif
+        #ifdef MQTT_LOG
+        // Queues a log line to be published from the loop
+        void            queueLog(LogLevel level, const char* line, size_t length);
+        // Publishes the queued log lines on the station log topic, within the bytes budget
+        void            drainLog();
+        #endif
+        #ifdef METRICS
+        // Publishes the runtime metrics on the station metrics topic and starts a new period
+        void            publishMetrics();
         #endif
         
+        /* Wifi connectivity */
+        void            beginWifiConnection();
+        // Runs the (blocking) configuration portal. Offered just on boot.
+        void            runConfigPortal();
+        // Advances the connectivity state machine. Called from loop().
+        void            tickConnectivity();
+        void            setConnectivityState(ConnectivityState state);
+        // Sets up mqtt, mDNS and the OTA update server the first time wifi gets connected
+        void            startNetworkServices();
+        // Blinks the feedback pin the given times without blocking
+        void            startFeedback(uint16_t period, uint8_t times);
+        void            tickFeedback();
+
+        // Sets the channels pins mode and drives the output ones to the channel state
+        void            initChannelsPins();
+        // Recomputes the earliest channel timer deadline, so the loop can skip timers checking until then
+        void            scheduleChannelsTimers();
+        // Takes the input pins changes once debounced. Called from loop().
+        void            tickInputs();
+        // Publishes the new state of the input and toggles its bound output
+        void            handleInputChange(Channel* input, uint8_t state);
+
         /* Utils */
+        // Mounts the file system the first time it is called
+        bool            mountFS();
+        // Opens the conf key-value store the first time it is called
+        bool            openConfStore();
+        // Moves a conf value kept in its own file (as previous versions did) into the store
+        bool            migrateLegacyConf(const char* key);
         bool            loadConfig();
+        bool            loadTextConfig(size_t size);
         void            saveConfig();
         bool            loadChannelsSettings();
+        // Writes the channel settings file. Returns false if it could not be written (the previous one is kept).
+        bool            writeChannelsSettings();
+        bool            loadTextChannelsSettings(size_t size);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,511 @@
+#include <stdio.h>
+#include <string.h>
+#include <ESPDomoticCore.h>
+
+uint32_t crc32(const uint8_t* data, size_t length) {
+  uint32_t crc = 0xFFFFFFFF;
+  while (length--) {
+    crc ^= *data++;
+    for (uint8_t i = 0; i < 8; ++i) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+uint16_t fnv1a16(const char* data, size_t length) {
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ (uint8_t) data[i]) * 16777619UL;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+PayloadView::PayloadView(const uint8_t* data, unsigned int length) {
+  this->data = data;
+  this->length = data ? length : 0;
+}
+
+bool PayloadView::toBool(bool* value) const {
+  if (length != 1 || (data[0] != '0' && data[0] != '1')) {
+    return false;
+  }
+  *value = data[0] == '1';
+  return true;
+}
+
+bool PayloadView::toUnsigned(unsigned long max, unsigned long* value) const {
+  if (length == 0) {
+    return false;
+  }
+  unsigned long parsed = 0;
+  for (unsigned int i = 0; i < length; ++i) {
+    if (data[i] < '0' || data[i] > '9') {
+      return false;
+    }
+    uint8_t digit = data[i] - '0';
+    if (digit > max || parsed > (max - digit) / 10) {
+      return false;
+    }
+    parsed = parsed * 10 + digit;
+  }
+  *value = parsed;
+  return true;
+}
+
+bool PayloadView::copyTo(char* buff, size_t size) const {
+  if (length >= size) {
+    return false;
+  }
+  for (unsigned int i = 0; i < length; ++i) {
+    if (data[i] < ' ' || data[i] == 0x7F) {
+      return false;
+    }
+    buff[i] = data[i];
+  }
+  buff[length] = '\0';
+  return true;
+}
+
+bool PayloadView::toTopicLevel(char* buff, size_t size) const {
+  if (length == 0 || !copyTo(buff, size)) {
+    return false;
+  }
+  return strpbrk(buff, "/+#") == NULL;
+}
+
+bool PayloadView::toChannelsStates(uint8_t count, uint32_t* on, uint32_t* off) const {
+  if (length == 0 || length > count || length > 32) {
+    return false;
+  }
+  *on = 0;
+  *off = 0;
+  for (unsigned int i = 0; i < length; ++i) {
+    if (data[i] == '1') {
+      *on |= 1UL << i;
+    } else if (data[i] == '0') {
+      *off |= 1UL << i;
+    } else if (data[i] != '-') {
+      return false;
+    }
+  }
+  return true;
+}
+
+void TopicDispatcher::build(const char* prefix, const char* const* names, uint8_t count) {
+  _prefix = prefix;
+  _prefixLength = strlen(prefix);
+  memset(_slots, 0, sizeof(_slots));
+  for (uint8_t i = 0; i < count && i < MAX_CHANNELS; ++i) {
+    Route& route = _routes[i];
+    route.name = names[i];
+    size_t nameLength;
+    route.hash = hashLevel(route.name, &nameLength);
+    route.nameLength = nameLength;
+    // Unnamed channels (or named as several levels) take no commands. The first of the channels sharing a name takes them.
+    if (route.nameLength == 0 || route.name[nameLength] != '\0' || findRoute(route.name, route.nameLength, route.hash) >= 0) {
+      continue;
+    }
+    uint8_t slot = route.hash % _slotsCount;
+    while (_slots[slot] != 0) {
+      slot = (slot + 1) % _slotsCount;
+    }
+    _slots[slot] = i + 1;
+  }
+}
+
+uint16_t TopicDispatcher::hashLevel(const char* level, size_t* length) {
+  *length = strcspn(level, "/");
+  return fnv1a16(level, *length);
+}
+
+int TopicDispatcher::findRoute(const char* level, size_t length, uint16_t hash) {
+  for (uint8_t probe = 0, slot = hash % _slotsCount; probe < _slotsCount && _slots[slot] != 0; ++probe, slot = (slot + 1) % _slotsCount) {
+    const Route& route = _routes[_slots[slot] - 1];
+    if (route.hash == hash && route.nameLength == length && memcmp(route.name, level, length) == 0) {
+      return _slots[slot] - 1;
+    }
+  }
+  return -1;
+}
+
+MqttCommand TopicDispatcher::resolve(const char* topic, uint8_t* channel) {
+  if (!_prefix || strncmp(topic, _prefix, _prefixLength) != 0) {
+    return CMD_UNKNOWN;
+  }
+  // The level after the prefix is "command" for the station commands, the channel name otherwise
+  const char* level = topic + _prefixLength;
+  size_t length;
+  uint16_t hash = hashLevel(level, &length);
+  const char* rest = level + length;
+  if (*rest != '/') {
+    return CMD_UNKNOWN;
+  }
+  // Station commands: <prefix>command/<cmd>
+  if (length == 7 && memcmp(level, "command", 7) == 0) {
+    MqttCommand cmd = resolveStationCommand(rest + 1);
+    if (cmd != CMD_UNKNOWN) {
+      return cmd;
+    }
+  }
+  // Channel commands: <prefix><channel name>/command/<cmd>
+  int route = findRoute(level, length, hash);
+  if (route < 0 || strncmp(rest, "/command/", 9) != 0) {
+    return CMD_UNKNOWN;
+  }
+  MqttCommand cmd = resolveChannelCommand(rest + 9);
+  if (cmd != CMD_UNKNOWN) {
+    *channel = route;
+  }
+  return cmd;
+}
+
+bool FeedbackQueue::push(Channel* channel, ChannelFeedback feedback) {
+  const uint8_t capacity = sizeof(_entries) / sizeof(_entries[0]);
+  for (uint8_t i = 0; i < _count; ++i) {
+    const Entry& entry = _entries[(_head + i) % capacity];
+    if (entry.channel == channel && entry.feedback == feedback) {
+      return true;
+    }
+  }
+  if (_count >= capacity) {
+    return false;
+  }
+  Entry& entry = _entries[(_head + _count) % capacity];
+  entry.channel = channel;
+  entry.feedback = feedback;
+  ++_count;
+  return true;
+}
+
+bool FeedbackQueue::peek(Channel** channel, ChannelFeedback* feedback) {
+  if (_count == 0) {
+    return false;
+  }
+  *channel = _entries[_head].channel;
+  *feedback = _entries[_head].feedback;
+  return true;
+}
+
+void FeedbackQueue::pop() {
+  if (_count > 0) {
+    _head = (_head + 1) % (sizeof(_entries) / sizeof(_entries[0]));
+    --_count;
+  }
+}
+
+bool FeedbackQueue::isEmpty() {
+  return _count == 0;
+}
+
+MqttCommand TopicDispatcher::resolveStationCommand(const char* cmd) {
+  if (strcmp(cmd, "hrst") == 0) {
+    return CMD_HARD_RESET;
+  } else if (strcmp(cmd, "rst") == 0) {
+    return CMD_SOFT_RESET;
+  } else if (strcmp(cmd, "states") == 0) {
+    return CMD_STATES;
+  }
+  return CMD_UNKNOWN;
+}
+
+MqttCommand TopicDispatcher::resolveChannelCommand(const char* cmd) {
+  if (strcmp(cmd, "state") == 0) {
+    return CMD_STATE;
+  } else if (strcmp(cmd, "enable") == 0) {
+    return CMD_ENABLE;
+  } else if (strcmp(cmd, "timer") == 0) {
+    return CMD_TIMER;
+  } else if (strcmp(cmd, "rename") == 0) {
+    return CMD_RENAME;
+  }
+  return CMD_UNKNOWN;
+}
+
+void RuntimeMetrics::recordLoop(uint32_t elapsedMicros) {
+  if (loops == 0 || elapsedMicros < loopMinMicros) {
+    loopMinMicros = elapsedMicros;
+  }
+  if (elapsedMicros > loopMaxMicros) {
+    loopMaxMicros = elapsedMicros;
+  }
+  loopTotalMicros += elapsedMicros;
+  ++loops;
+}
+
+void RuntimeMetrics::resetLoop() {
+  loopMinMicros = 0;
+  loopMaxMicros = 0;
+  loopTotalMicros = 0;
+  loops = 0;
+}
+
+size_t RuntimeMetrics::format(char* buff, size_t size, uint32_t freeHeap, uint32_t maxFreeBlock) const {
+  int length = snprintf(buff, size,
+    "{\"loopMin\":%lu,\"loopAvg\":%lu,\"loopMax\":%lu,\"heap\":%lu,\"maxBlock\":%lu,"
+    "\"reconnections\":%lu,\"connectMillis\":%lu,\"handled\":%lu,\"dropped\":%lu,\"feedbackDropped\":%lu,\"flashWrites\":%lu}",
+    (unsigned long) loopMinMicros,
+    (unsigned long) (loops ? loopTotalMicros / loops : 0),
+    (unsigned long) loopMaxMicros,
+    (unsigned long) freeHeap,
+    (unsigned long) maxFreeBlock,
+    (unsigned long) reconnections,
+    (unsigned long) connectMillis,
+    (unsigned long) messagesHandled,
+    (unsigned long) messagesDropped,
+    (unsigned long) feedbackDropped,
+    (unsigned long) flashWrites);
+  return length < 0 || (size_t) length >= size ? 0 : length;
+}
+
+bool LogRing::push(uint8_t level, const char* text, size_t length) {
+  if (length > 255) {
+    length = 255;
+  }
+  uint16_t head = _head;
+  if ((uint16_t) (head - _tail) + 2 + length > MQTT_LOG_BUFFER_SIZE) {
+    ++_dropped;
+    return false;
+  }
+  _buff[head++ & (MQTT_LOG_BUFFER_SIZE - 1)] = level;
+  _buff[head++ & (MQTT_LOG_BUFFER_SIZE - 1)] = (uint8_t) length;
+  for (size_t i = 0; i < length; ++i) {
+    _buff[head++ & (MQTT_LOG_BUFFER_SIZE - 1)] = text[i];
+  }
+  // The line is published to the consumer once completely written
+  _head = head;
+  return true;
+}
+
+size_t LogRing::peek(uint8_t* level, char* buff, size_t size) {
+  uint16_t tail = _tail;
+  if (tail == _head || size == 0) {
+    return 0;
+  }
+  *level = _buff[tail++ & (MQTT_LOG_BUFFER_SIZE - 1)];
+  size_t length = _buff[tail++ & (MQTT_LOG_BUFFER_SIZE - 1)];
+  if (length > size - 1) {
+    length = size - 1;
+  }
+  for (size_t i = 0; i < length; ++i) {
+    buff[i] = _buff[tail++ & (MQTT_LOG_BUFFER_SIZE - 1)];
+  }
+  buff[length] = '\0';
+  return length;
+}
+
+void LogRing::pop() {
+  uint16_t tail = _tail;
+  if (tail != _head) {
+    tail += 2 + _buff[(tail + 1) & (MQTT_LOG_BUFFER_SIZE - 1)];
+    _tail = tail;
+  }
+}
+
+bool LogRing::isEmpty() {
+  return _tail == _head;
+}
+
+uint16_t LogRing::takeDropped() {
+  uint16_t dropped = _dropped;
+  _dropped -= dropped;
+  return dropped;
+}
+
+bool InputEventQueue::pop(InputEvent* event) {
+  uint8_t tail = _tail;
+  if (tail == _head) {
+    return false;
+  }
+  *event = _events[tail & (INPUT_EVENTS_QUEUE_SIZE - 1)];
+  _tail = tail + 1;
+  return true;
+}
+
+bool InputEventQueue::takeOverflowed() {
+  if (!_overflowed) {
+    return false;
+  }
+  _overflowed = false;
+  return true;
+}
+
+bool topicMatches(const char* filter, const char* topic) {
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+    }
+    if (*filter == '+') {
+      // Matches a whole level, even an empty one
+      while (*topic && *topic != '/') {
+        ++topic;
+      }
+      ++filter;
+      continue;
+    }
+    if (*filter != *topic) {
+      // "a/#" matches "a" too
+      return *topic == '\0' && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+    }
+    ++filter;
+    ++topic;
+  }
+  return *topic == '\0';
+}
+
+bool LoopbackTransport::connect(const char* /* clientId */, const char* willTopic, uint8_t /* willQos */, bool willRetain, const char* willMessage, bool cleanSession) {
+  _connected = _online;
+  if (!_connected) {
+    return false;
+  }
+  if (cleanSession) {
+    memset(_subscriptions, 0, sizeof(_subscriptions));
+  }
+  _willTopic[0] = '\0';
+  if (willTopic && willMessage && strlen(willTopic) < sizeof(_willTopic) && strlen(willMessage) < sizeof(_willMessage)) {
+    strcpy(_willTopic, willTopic);
+    strcpy(_willMessage, willMessage);
+    _willRetain = willRetain;
+  }
+  return true;
+}
+
+bool LoopbackTransport::connected() {
+  return _connected;
+}
+
+int LoopbackTransport::state() {
+  return _connected ? 0 : -1;
+}
+
+bool LoopbackTransport::loop() {
+  if (!_connected) {
+    return false;
+  }
+  // Just the messages queued so far, the ones published while handling them wait for the next loop
+  for (uint8_t delivered = _count; delivered > 0 && _connected; --delivered) {
+    // Popped once handled, so the messages published meanwhile can not take its slot
+    Message& message = _queue[_head];
+    if (_callback) {
+      _callback(message.topic, message.payload, message.length);
+    }
+    _head = (_head + 1) % LOOPBACK_QUEUE_SIZE;
+    --_count;
+  }
+  return _connected;
+}
+
+bool LoopbackTransport::subscribe(const char* topic, uint8_t /* qos */) {
+  if (!_connected || strlen(topic) >= _loopbackTopicMaxLength) {
+    return false;
+  }
+  char* free = NULL;
+  for (uint8_t i = 0; i < LOOPBACK_MAX_SUBSCRIPTIONS; ++i) {
+    if (strcmp(_subscriptions[i], topic) == 0) {
+      return true;
+    }
+    if (!free && _subscriptions[i][0] == '\0') {
+      free = _subscriptions[i];
+    }
+  }
+  if (!free) {
+    return false;
+  }
+  strcpy(free, topic);
+  return true;
+}
+
+bool LoopbackTransport::unsubscribe(const char* topic) {
+  for (uint8_t i = 0; i < LOOPBACK_MAX_SUBSCRIPTIONS; ++i) {
+    if (strcmp(_subscriptions[i], topic) == 0) {
+      _subscriptions[i][0] = '\0';
+    }
+  }
+  return _connected;
+}
+
+bool LoopbackTransport::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  if (!_connected) {
+    return false;
+  }
+  if (_observer) {
+    _observer(topic, payload, length, retained);
+  }
+  return !isSubscribed(topic) || inject(topic, payload, length);
+}
+
+bool LoopbackTransport::beginPublish(const char* topic, unsigned int length, bool retained) {
+  if (!_connected || strlen(topic) >= _loopbackTopicMaxLength || length > _loopbackPublishMaxLength) {
+    ++dropped;
+    return false;
+  }
+  strcpy(_pendingTopic, topic);
+  _pendingLength = 0;
+  _pendingExpected = length;
+  _pendingRetained = retained;
+  return true;
+}
+
+size_t LoopbackTransport::write(const uint8_t* data, size_t length) {
+  if (length > _pendingExpected - _pendingLength) {
+    length = _pendingExpected - _pendingLength;
+  }
+  memcpy(_pendingPayload + _pendingLength, data, length);
+  _pendingLength += length;
+  return length;
+}
+
+bool LoopbackTransport::endPublish() {
+  // As the broker would, a message shorter or longer than announced is not delivered
+  if (_pendingLength != _pendingExpected) {
+    ++dropped;
+    return false;
+  }
+  return publish(_pendingTopic, _pendingPayload, _pendingLength, _pendingRetained);
+}
+
+void LoopbackTransport::setCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) {
+  _callback = callback;
+}
+
+bool LoopbackTransport::inject(const char* topic, const uint8_t* payload, unsigned int length) {
+  if (_count >= LOOPBACK_QUEUE_SIZE || strlen(topic) >= _loopbackTopicMaxLength || length > _loopbackPayloadMaxLength) {
+    ++dropped;
+    return false;
+  }
+  Message& message = _queue[(_head + _count) % LOOPBACK_QUEUE_SIZE];
+  strcpy(message.topic, topic);
+  memcpy(message.payload, payload, length);
+  message.length = length;
+  ++_count;
+  return true;
+}
+
+void LoopbackTransport::setOnline(bool online) {
+  _online = online;
+  if (!online && _connected) {
+    // The broker sees the client gone and publishes its last will on its behalf
+    if (_willTopic[0] != '\0') {
+      if (_observer) {
+        _observer(_willTopic, (const uint8_t*) _willMessage, strlen(_willMessage), _willRetain);
+      }
+      if (isSubscribed(_willTopic)) {
+        inject(_willTopic, (const uint8_t*) _willMessage, strlen(_willMessage));
+      }
+    }
+    _connected = false;
+  }
+}
+
+void LoopbackTransport::setPublishObserver(std::function<void(const char*, const uint8_t*, unsigned int, bool)> observer) {
+  _observer = observer;
+}
+
+bool LoopbackTransport::isSubscribed(const char* topic) {
+  for (uint8_t i = 0; i < LOOPBACK_MAX_SUBSCRIPTIONS; ++i) {
+    if (_subscriptions[i][0] != '\0' && topicMatches(_subscriptions[i], topic)) {
+      return true;
+    }
+  }
+  return false;
+}
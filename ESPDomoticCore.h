@@ -0,0 +1,360 @@
+#ifndef ESPDomoticCore_h
+#define ESPDomoticCore_h
+
+/*
+Platform independent pieces of the lib: topics dispatching, payloads parsing, feedback queueing and time keeping.
+They do not depend on Arduino nor ESP8266 headers, so they can be built and exercised on a host.
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <functional>
+
+// Channels capacity. As the lib is compiled apart from the sketch it must be set as a build flag (-DMAX_CHANNELS=16)
+#ifndef MAX_CHANNELS
+#define MAX_CHANNELS 4
+#endif
+// Channels sets are handled as bitmasks
+static_assert(MAX_CHANNELS > 0 && MAX_CHANNELS <= 32, "MAX_CHANNELS must be between 1 and 32");
+
+class Channel;
+
+// Tells if the deadline (in millis) has been reached at now. Safe across the 49 days millis() overflow.
+inline bool deadlineReached(uint32_t now, uint32_t deadline) {
+    return (int32_t) (now - deadline) >= 0;
+}
+
+// Tells if the deadline a comes before the deadline b. Safe across the millis() overflow.
+inline bool deadlineBefore(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
+// Standard CRC32 (the one used by zip)
+uint32_t crc32(const uint8_t* data, size_t length);
+
+// FNV-1a folded to 16 bits, to index short keys (topic levels, conf keys)
+uint16_t fnv1a16(const char* data, size_t length);
+
+/*
+Read only view over a received mqtt payload (wich is not null terminated), with strict and allocation free parsers.
+Parsers reject the whole payload on any unexpected char, so trailing garbage is never accepted.
+*/
+class PayloadView {
+    public:
+        PayloadView(const uint8_t* data, unsigned int length);
+
+        const uint8_t*  data;
+        unsigned int    length;
+
+        // Parses a "0" or "1" payload
+        bool    toBool(bool* value) const;
+        // Parses a decimal number, not greater than max. No sign nor spaces are accepted.
+        bool    toUnsigned(unsigned long max, unsigned long* value) const;
+        // Copies the payload as a null terminated string. Fails if it does not fit or holds control chars.
+        bool    copyTo(char* buff, size_t size) const;
+        // As copyTo, but the payload must also be a valid (not empty and wildcard free) mqtt topic level
+        bool    toTopicLevel(char* buff, size_t size) const;
+        /*
+            Parses a states list, one char per channel in order: '1' on, '0' off, '-' kept. Channels past the
+            end of the list are kept. Returns the channels to turn on and off as bitmasks.
+        */
+        bool    toChannelsStates(uint8_t count, uint32_t* on, uint32_t* off) const;
+};
+
+// Feedback a channel reports through mqtt
+enum ChannelFeedback {
+    FEEDBACK_STATE,
+    FEEDBACK_ENABLE
+};
+
+/*
+Holds the channels feedback that could not be published while the broker was unreachable.
+Entries are coalesced by channel and feedback type, so the queue never holds more than one entry per pair
+and its capacity is bounded by MAX_CHANNELS. The value published is read from the channel when flushing,
+so the latest one is always reported.
+*/
+class FeedbackQueue {
+    public:
+        // Queues the feedback unless it is already pending. Returns false if the queue is full.
+        bool            push(Channel* channel, ChannelFeedback feedback);
+        // Returns the oldest pending feedback without removing it. False if there is none.
+        bool            peek(Channel** channel, ChannelFeedback* feedback);
+        // Removes the oldest pending feedback
+        void            pop();
+        bool            isEmpty();
+
+    private:
+        struct Entry {
+            Channel*        channel;
+            ChannelFeedback feedback;
+        };
+
+        Entry           _entries[MAX_CHANNELS * 2];
+        uint8_t         _head   = 0;
+        uint8_t         _count  = 0;
+};
+
+// Commands the module understands when received through mqtt
+enum MqttCommand {
+    CMD_UNKNOWN,
+    CMD_HARD_RESET,
+    CMD_SOFT_RESET,
+    CMD_ENABLE,
+    CMD_TIMER,
+    CMD_RENAME,
+    CMD_STATE,
+    CMD_STATES
+};
+
+/*
+Maps the topics the module is subscribed to into a command and the channel it targets.
+The table is built once the station topic prefix is known and has to be rebuilt whenever a channel is renamed.
+The level after the prefix is hashed while it is scanned and looked up in an open addressing table of the channels
+names, so a topic is resolved in a single pass whatever the channels count, without allocating.
+*/
+class TopicDispatcher {
+    public:
+        // Rebuilds the dispatch table. The prefix (type/location/name/) and the channels names must outlive the table.
+        void            build(const char* prefix, const char* const* names, uint8_t count);
+        // Returns the command the topic refers to. For channel commands the channel index is stored in channel.
+        MqttCommand     resolve(const char* topic, uint8_t* channel);
+
+    private:
+        struct Route {
+            const char* name;
+            uint8_t     nameLength;
+            uint16_t    hash;
+        };
+
+        // Half empty keeps probe sequences short
+        static const uint8_t    _slotsCount = MAX_CHANNELS * 2;
+
+        const char*     _prefix         = NULL;
+        size_t          _prefixLength   = 0;
+        Route           _routes[MAX_CHANNELS];
+        // Index of the route (plus one) hashed into each slot, 0 if empty
+        uint8_t         _slots[_slotsCount] = {};
+
+        // Hashes the topic level, up to the next separator, storing its length
+        static uint16_t hashLevel(const char* level, size_t* length);
+        // Returns the index of the channel named as the level, -1 if none
+        int             findRoute(const char* level, size_t length, uint16_t hash);
+        MqttCommand     resolveStationCommand(const char* cmd);
+        MqttCommand     resolveChannelCommand(const char* cmd);
+};
+/*
+Runtime figures published on the station metrics topic (when built with METRICS).
+Loop figures cover the last publish period, counters are kept since boot.
+*/
+struct RuntimeMetrics {
+    uint32_t    loopMinMicros;
+    uint32_t    loopMaxMicros;
+    uint64_t    loopTotalMicros;
+    uint32_t    loops;
+    uint32_t    reconnections;
+    // Commands carried out, even if they left the channels as they were, and commands rejected
+    uint32_t    messagesHandled;
+    uint32_t    messagesDropped;
+    // Channels feedback lost on a full pending feedback queue
+    uint32_t    feedbackDropped;
+    uint32_t    flashWrites;
+    // Millis the last broker connection took, subscriptions included
+    uint32_t    connectMillis;
+
+    void    recordLoop(uint32_t elapsedMicros);
+    // Starts a new period of loop figures
+    void    resetLoop();
+    // Writes the metrics as a json object into buff. Heap figures are platform dependent, so they are given.
+    size_t  format(char* buff, size_t size, uint32_t freeHeap, uint32_t maxFreeBlock) const;
+};
+
+// Log levels, from the most to the least severe. Defined as macros so the preprocessor can filter them out.
+#define DOMOTIC_LOG_LEVEL_NONE  0
+#define DOMOTIC_LOG_LEVEL_ERROR 1
+#define DOMOTIC_LOG_LEVEL_WARN  2
+#define DOMOTIC_LOG_LEVEL_INFO  3
+#define DOMOTIC_LOG_LEVEL_DEBUG 4
+typedef uint8_t LogLevel;
+
+// Bytes kept for the log lines waiting to be published. Must be a power of 2.
+#ifndef MQTT_LOG_BUFFER_SIZE
+#define MQTT_LOG_BUFFER_SIZE 512
+#endif
+static_assert(MQTT_LOG_BUFFER_SIZE >= 64 && MQTT_LOG_BUFFER_SIZE <= 4096 && (MQTT_LOG_BUFFER_SIZE & (MQTT_LOG_BUFFER_SIZE - 1)) == 0,
+    "MQTT_LOG_BUFFER_SIZE must be a power of 2 between 64 and 4096");
+
+/*
+Ring buffer of log lines, each kept as [level][length][text]. Lines are pushed by the logging calls and drained from
+the loop, so logging never publishes. It is lock free as long as there is a single producer and a single consumer:
+the producer just moves the head and the consumer just moves the tail.
+*/
+class LogRing {
+    public:
+        // Queues a line (truncated to 255 chars). Returns false, counting it as dropped, if there is no room for it.
+        bool        push(uint8_t level, const char* text, size_t length);
+        // Copies the oldest line into buff (null terminated, truncated to size). Returns its length, 0 if none.
+        size_t      peek(uint8_t* level, char* buff, size_t size);
+        // Drops the oldest line
+        void        pop();
+        bool        isEmpty();
+        // Returns the lines dropped since the last call
+        uint16_t    takeDropped();
+
+    private:
+        uint8_t             _buff[MQTT_LOG_BUFFER_SIZE];
+        // Free running counters, masked to index the buffer
+        volatile uint16_t   _head       = 0;
+        volatile uint16_t   _tail       = 0;
+        volatile uint16_t   _dropped    = 0;
+};
+
+// Input pins changes kept until handled. Must be a power of 2.
+#ifndef INPUT_EVENTS_QUEUE_SIZE
+#define INPUT_EVENTS_QUEUE_SIZE 16
+#endif
+static_assert(INPUT_EVENTS_QUEUE_SIZE >= 2 && INPUT_EVENTS_QUEUE_SIZE <= 128 && (INPUT_EVENTS_QUEUE_SIZE & (INPUT_EVENTS_QUEUE_SIZE - 1)) == 0,
+    "INPUT_EVENTS_QUEUE_SIZE must be a power of 2 between 2 and 128");
+
+// An input pin edge: the channel index and the millis it happened at
+struct InputEvent {
+    uint8_t     channel;
+    uint32_t    time;
+};
+
+/*
+Queue of input pins edges, pushed from the pins interrupts and popped from the loop.
+Lock free for a single producer (the interrupts do not nest) and a single consumer.
+*/
+class InputEventQueue {
+    public:
+        // Called from interrupts. Forced inline into the (IRAM) interrupt handler, an out of line copy would live in flash.
+        inline __attribute__((always_inline)) bool push(uint8_t channel, uint32_t time) {
+            uint8_t head = _head;
+            if ((uint8_t) (head - _tail) >= INPUT_EVENTS_QUEUE_SIZE) {
+                _overflowed = true;
+                return false;
+            }
+            _events[head & (INPUT_EVENTS_QUEUE_SIZE - 1)].channel = channel;
+            _events[head & (INPUT_EVENTS_QUEUE_SIZE - 1)].time = time;
+            _head = head + 1;
+            return true;
+        }
+        bool    pop(InputEvent* event);
+        // Tells if edges were lost (queue full) since the last call
+        bool    takeOverflowed();
+
+    private:
+        InputEvent          _events[INPUT_EVENTS_QUEUE_SIZE];
+        volatile uint8_t    _head       = 0;
+        volatile uint8_t    _tail       = 0;
+        volatile bool       _overflowed = false;
+};
+
+// Tells if the topic matches the mqtt subscription filter (with + and # wildcards)
+bool topicMatches(const char* filter, const char* topic);
+
+/*
+The messaging layer the module talks through. By default it is the mqtt client (PubSubClient), but it can be
+swapped, e.g. by a loopback to replay recorded traffic against the module or to instrument it.
+*/
+class MessageTransport {
+    public:
+        virtual ~MessageTransport() {}
+
+        virtual bool    connect(const char* clientId, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) = 0;
+        virtual bool    connected() = 0;
+        // Connection state, as PubSubClient::state() reports it (0 connected)
+        virtual int     state() = 0;
+        // Processes the incoming messages. Returns false if the connection is lost.
+        virtual bool    loop() = 0;
+        virtual bool    subscribe(const char* topic, uint8_t qos) = 0;
+        virtual bool    unsubscribe(const char* topic) = 0;
+        virtual bool    publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) = 0;
+        // Publishes a message of a known length in pieces
+        virtual bool    beginPublish(const char* topic, unsigned int length, bool retained) = 0;
+        virtual size_t  write(const uint8_t* data, size_t length) = 0;
+        virtual bool    endPublish() = 0;
+        virtual void    setCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) = 0;
+        // Whether it goes through the wifi. The module runs the ones that do not even while standalone.
+        virtual bool    needsNetwork() { return true; }
+
+        bool publish(const char* topic, const char* payload, bool retained = false) {
+            return publish(topic, (const uint8_t*) payload, strlen(payload), retained);
+        }
+};
+
+// Room for a command per channel in flight plus the station ones
+#ifndef LOOPBACK_QUEUE_SIZE
+#define LOOPBACK_QUEUE_SIZE (MAX_CHANNELS + 4)
+#endif
+// Each channel subscribes its command topics, plus the station ones
+#ifndef LOOPBACK_MAX_SUBSCRIPTIONS
+#define LOOPBACK_MAX_SUBSCRIPTIONS (MAX_CHANNELS + 4)
+#endif
+const uint8_t   _loopbackTopicMaxLength     = 128;
+// Queued messages are commands, wich are short. Longer ones are dropped and counted.
+const uint16_t  _loopbackPayloadMaxLength   = 128;
+// A message published in pieces may be the station snapshot, up to 128 bytes per channel
+const uint16_t  _loopbackPublishMaxLength   = 16 + MAX_CHANNELS * 128;
+
+/*
+In process transport, with no network nor broker. Messages published to a subscribed topic, and the ones injected,
+are queued and delivered from loop(), as a broker would. Every publish is also handed to the publish observer.
+Messages that do not fit the queue make publish and inject return false and are counted as dropped. Going offline
+while connected publishes the last will, as the broker does when a client is lost.
+*/
+class LoopbackTransport : public MessageTransport {
+    public:
+        bool    connect(const char* clientId, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession) override;
+        bool    connected() override;
+        int     state() override;
+        bool    loop() override;
+        bool    subscribe(const char* topic, uint8_t qos) override;
+        bool    unsubscribe(const char* topic) override;
+        bool    publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) override;
+        bool    beginPublish(const char* topic, unsigned int length, bool retained) override;
+        size_t  write(const uint8_t* data, size_t length) override;
+        bool    endPublish() override;
+        void    setCallback(std::function<void(char*, uint8_t*, unsigned int)> callback) override;
+        bool    needsNetwork() override { return false; }
+
+        using MessageTransport::publish;
+
+        // Queues an incoming message, as if it came from the broker. Returns false if the queue is full.
+        bool    inject(const char* topic, const uint8_t* payload, unsigned int length);
+        // Simulates the broker being reachable or not. Going offline drops the connection.
+        void    setOnline(bool online);
+        void    setPublishObserver(std::function<void(const char*, const uint8_t*, unsigned int, bool)> observer);
+        // Messages dropped because the queue was full or they were too long
+        uint32_t    dropped = 0;
+
+    private:
+        struct Message {
+            char            topic[_loopbackTopicMaxLength];
+            uint8_t         payload[_loopbackPayloadMaxLength];
+            unsigned int    length;
+        };
+
+        bool    _online     = true;
+        bool    _connected  = false;
+        char    _subscriptions[LOOPBACK_MAX_SUBSCRIPTIONS][_loopbackTopicMaxLength] = {};
+        Message _queue[LOOPBACK_QUEUE_SIZE];
+        uint8_t _head       = 0;
+        uint8_t _count      = 0;
+        // Message being published in pieces
+        char            _pendingTopic[_loopbackTopicMaxLength];
+        uint8_t         _pendingPayload[_loopbackPublishMaxLength];
+        unsigned int    _pendingLength      = 0;
+        unsigned int    _pendingExpected    = 0;
+        bool            _pendingRetained    = false;
+        // Last will, published when going offline
+        char    _willTopic[_loopbackTopicMaxLength] = {};
+        char    _willMessage[_loopbackPayloadMaxLength] = {};
+        bool    _willRetain = false;
+        std::function<void(char*, uint8_t*, unsigned int)>              _callback;
+        std::function<void(const char*, const uint8_t*, unsigned int, bool)> _observer;
+
+        bool    isSubscribed(const char* topic);
+};
+
+#endif
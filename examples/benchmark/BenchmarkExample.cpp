@@ -0,0 +1,202 @@
+#include <ESPDomotic.h>
+
+/*
+Measures, on the device, the cost of the mqtt command path and of the loop iterations.
+The sketch publishes commands to its own channels topics at a fixed rate, wich come back from the broker
+and get handled by the module as any other command. Each report window a csv line is printed over serial:
+
+bench,<mix>,<channels>,<messages>,<loop avg us>,<msg loop avg us>,<msg loop max us>,<heap held max>,<max block drop max>,<min free heap>,<loops per sec>
+
+> msg loop: loop iterations in wich a message was handled (network read included)
+> heap held: heap still taken once a message is handled, compared to the heap free before the loop iteration.
+  Memory allocated and released while handling it is not seen, so this is not an allocations count. The host
+  benchmark (make -C test bench) counts the allocations, wrapping malloc.
+> max block drop: how much the largest free heap block shrank over the same span, a sign of the fragmentation
+  the command path leaves behind
+
+Build flags:
+> BENCH_CHANNELS: channels to manage (not more than MAX_CHANNELS)
+> BENCH_MIX: 0 mixed, 1 state, 2 timer, 3 rename, 4 enable
+> BENCH_RATE: commands published per second
+> BENCH_LOOPBACK: commands go through an in process loopback instead of the broker, so just the module cost is measured
+*/
+
+#ifndef BENCH_CHANNELS
+#define BENCH_CHANNELS MAX_CHANNELS
+#endif
+#ifndef BENCH_MIX
+#define BENCH_MIX 0
+#endif
+#ifndef BENCH_RATE
+#define BENCH_RATE 20
+#endif
+
+static_assert(BENCH_CHANNELS > 0 && BENCH_CHANNELS <= MAX_CHANNELS, "BENCH_CHANNELS must be between 1 and MAX_CHANNELS");
+
+const unsigned long REPORT_PERIOD   = 10 * 1000;
+const char*         MIX_NAMES[]     = {"mixed", "state", "timer", "rename", "enable"};
+
+#ifdef NODEMCUV2
+const uint8_t       PINS[]          = {D1, D2, D5, D6, D7, D0};
+#else
+const uint8_t       PINS[]          = {4, 5, 12, 13, 14, 16};
+#endif
+
+void mqttConnectionCallback();
+void receiveMqttMessage(char* topic, uint8_t* payload, unsigned int length);
+void publishCommand();
+void report();
+
+ESPDomotic      _domoticModule;
+#ifdef BENCH_LOOPBACK
+LoopbackTransport _loopback;
+#endif
+Channel*        _benchChannels[BENCH_CHANNELS];
+char            _channelIds[BENCH_CHANNELS][4];
+char            _channelNames[BENCH_CHANNELS][8];
+
+bool            _brokerConnected  = false;
+unsigned long   _nextCommand      = 0;
+unsigned long   _reportStart      = 0;
+uint32_t        _sequence         = 0;
+
+// Current window figures
+uint32_t        _loops            = 0;
+uint64_t        _loopsMicros      = 0;
+uint32_t        _messages         = 0;
+uint64_t        _msgLoopsMicros   = 0;
+uint32_t        _msgLoopMaxMicros = 0;
+uint32_t        _heapHeldMax      = 0;
+uint32_t        _maxBlockDropMax  = 0;
+uint32_t        _minFreeHeap      = UINT32_MAX;
+
+// Set by the message callback during the running loop iteration
+bool            _messageHandled   = false;
+uint32_t        _heapBeforeLoop   = 0;
+uint32_t        _maxBlockBeforeLoop = 0;
+
+void setup() {
+  Serial.begin(115200);
+  delay(500);
+  Serial.println();
+  for (uint8_t i = 0; i < BENCH_CHANNELS; ++i) {
+    // Ids are the keys of the channels settings, so they must not repeat
+    snprintf(_channelIds[i], sizeof(_channelIds[i]), "C%d", i);
+    snprintf(_channelNames[i], sizeof(_channelNames[i]), "ch%d", i);
+    _benchChannels[i] = new Channel(_channelIds[i], _channelNames[i], PINS[i % sizeof(PINS)], OUTPUT, HIGH);
+    _domoticModule.addChannel(_benchChannels[i]);
+  }
+  String ssid = "Benchmark " + String(ESP.getChipId());
+  _domoticModule.setPortalSSID(ssid.c_str());
+  _domoticModule.setMqttConnectionCallback(mqttConnectionCallback);
+  _domoticModule.setMqttMessageCallback(receiveMqttMessage);
+  _domoticModule.setConfigPortalTimeout(90);
+  _domoticModule.setWifiConnectTimeout(45);
+  _domoticModule.setModuleType("bench");
+  #ifdef BENCH_LOOPBACK
+  _domoticModule.setTransport(&_loopback);
+  #endif
+  _domoticModule.init();
+  Serial.println(F("bench,mix,channels,messages,loop_avg_us,msg_loop_avg_us,msg_loop_max_us,heap_held_max,max_block_drop_max,min_free_heap,loops_per_sec"));
+  _reportStart = millis();
+}
+
+void loop() {
+  _heapBeforeLoop = ESP.getFreeHeap();
+  _maxBlockBeforeLoop = ESP.getMaxFreeBlockSize();
+  _messageHandled = false;
+  uint32_t start = micros();
+  _domoticModule.loop();
+  uint32_t elapsed = micros() - start;
+  ++_loops;
+  _loopsMicros += elapsed;
+  if (_messageHandled) {
+    _msgLoopsMicros += elapsed;
+    if (elapsed > _msgLoopMaxMicros) {
+      _msgLoopMaxMicros = elapsed;
+    }
+  }
+  if (_brokerConnected && deadlineReached(millis(), _nextCommand)) {
+    _nextCommand = millis() + 1000 / BENCH_RATE;
+    publishCommand();
+  }
+  if (deadlineReached(millis(), _reportStart + REPORT_PERIOD)) {
+    report();
+  }
+}
+
+void publishCommand() {
+  uint8_t kind = BENCH_MIX == 0 ? 1 + _sequence % 4 : BENCH_MIX;
+  Channel* channel = _benchChannels[_sequence % BENCH_CHANNELS];
+  const char* payload;
+  const char* suffix;
+  switch (kind) {
+    case 2:
+      suffix = "command/timer";
+      payload = "600";
+      break;
+    case 3:
+      // Same name, so the channel topics are kept
+      suffix = "command/rename";
+      payload = channel->name;
+      break;
+    case 4:
+      suffix = "command/enable";
+      payload = "1";
+      break;
+    default:
+      suffix = "command/state";
+      payload = (_sequence / BENCH_CHANNELS) % 2 ? "1" : "0";
+      break;
+  }
+  char topic[_topicMaxLength];
+  _domoticModule.getChannelTopic(channel, suffix, topic, sizeof(topic));
+  _domoticModule.getTransport()->publish(topic, payload);
+  ++_sequence;
+}
+
+void report() {
+  unsigned long window = millis() - _reportStart;
+  Serial.printf("bench,%s,%d,%u,%u,%u,%u,%u,%u,%u,%u\n",
+    MIX_NAMES[BENCH_MIX],
+    BENCH_CHANNELS,
+    _messages,
+    _loops ? (uint32_t) (_loopsMicros / _loops) : 0,
+    _messages ? (uint32_t) (_msgLoopsMicros / _messages) : 0,
+    _msgLoopMaxMicros,
+    _heapHeldMax,
+    _maxBlockDropMax,
+    _minFreeHeap == UINT32_MAX ? ESP.getFreeHeap() : _minFreeHeap,
+    (uint32_t) (_loops * 1000ULL / (window ? window : 1)));
+  _loops = 0;
+  _loopsMicros = 0;
+  _messages = 0;
+  _msgLoopsMicros = 0;
+  _msgLoopMaxMicros = 0;
+  _heapHeldMax = 0;
+  _maxBlockDropMax = 0;
+  _minFreeHeap = UINT32_MAX;
+  _reportStart = millis();
+}
+
+void mqttConnectionCallback() {
+  _brokerConnected = true;
+  _nextCommand = millis();
+}
+
+void receiveMqttMessage(char* topic, uint8_t* payload, unsigned int length) {
+  // Called once the module has handled the message, so the heap it still holds is what the command path took
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < _minFreeHeap) {
+    _minFreeHeap = freeHeap;
+  }
+  if (_heapBeforeLoop > freeHeap && _heapBeforeLoop - freeHeap > _heapHeldMax) {
+    _heapHeldMax = _heapBeforeLoop - freeHeap;
+  }
+  uint32_t maxBlock = ESP.getMaxFreeBlockSize();
+  if (_maxBlockBeforeLoop > maxBlock && _maxBlockBeforeLoop - maxBlock > _maxBlockDropMax) {
+    _maxBlockDropMax = _maxBlockBeforeLoop - maxBlock;
+  }
+  _messageHandled = true;
+  ++_messages;
+}
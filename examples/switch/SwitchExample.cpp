@@ -1,6 +1,5 @@
 #include <ESPDomotic.h>
 
-void processInput();
 void mqttConnectionCallback();
 void receiveMqttMessage(char* topic, uint8_t* payload, unsigned int length);
 
@@ -22,6 +21,8 @@ const uint8_t LED_PIN     = 12;
 #endif
 
 Channel _light ("A", "Light", RELAY_PIN, OUTPUT, HIGH);
+// The wall switch. Its changes are published and toggle the light, even while the module is offline.
+Channel _switch ("B", "Switch", SWITCH_PIN, INPUT, HIGH);
 
 template <class T> void log (T text) {
   #ifdef LOGGING
@@ -40,7 +41,6 @@ template <class T, class U> void log (T key, U value) {
 }
 
 ESPDomotic  _domoticModule;
-uint8_t     switchState = LOW;
 
 void setup() {
 #ifdef ESP01
@@ -51,7 +51,6 @@ void setup() {
 #endif
   delay(500);
   Serial.println();
-  switchState = digitalRead(SWITCH_PIN);
   log("Starting module");
   String ssid = "Light switch " + String(ESP.getChipId());
   _domoticModule.setPortalSSID(ssid.c_str());
@@ -65,24 +64,14 @@ void setup() {
   _domoticModule.setConfigFileSize(256);
   _domoticModule.setModuleType("light");
   _domoticModule.addChannel(&_light);
+  _domoticModule.addChannel(&_switch);
+  _switch.debounce = 30;
+  _domoticModule.bindInputChannel(&_switch, &_light);
   _domoticModule.init();
 }
 
 void loop() {
   _domoticModule.loop();
-  processInput();
-}
-
-void processInput() {
-  int read = digitalRead(SWITCH_PIN);
-  if (read != switchState) {
-    log(F("Switch state has changed"));
-    switchState = read;
-    _light.state = _light.state == LOW ? HIGH : LOW;
-    digitalWrite(_light.pin, _light.state);
-    _domoticModule.getMqttClient()->publish(_domoticModule.getChannelTopic(&_light, "feedback/state").c_str(), _light.state == LOW ? "1" : "0");
-    log(F("Output channel state changed to"), _light.state == LOW ? "ON" : "OFF");
-  }
 }
 
 void mqttConnectionCallback() {
@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include "bench.h"
+
+/*
+malloc family wrapped over the glibc entry points, so the allocations made by the module, the shims and the standard
+library (operator new goes through malloc) are all counted.
+*/
+extern "C" {
+    void*   __libc_malloc(size_t size);
+    void*   __libc_calloc(size_t count, size_t size);
+    void*   __libc_realloc(void* ptr, size_t size);
+    void    __libc_free(void* ptr);
+}
+
+namespace alloc {
+    volatile bool   counting    = false;
+    volatile size_t count       = 0;
+    volatile size_t bytes       = 0;
+}
+
+static inline void countAllocation(size_t size) {
+  if (alloc::counting) {
+    alloc::count = alloc::count + 1;
+    alloc::bytes = alloc::bytes + size;
+  }
+}
+
+extern "C" void* malloc(size_t size) {
+  countAllocation(size);
+  return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size) {
+  countAllocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* ptr, size_t size) {
+  countAllocation(size);
+  return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void* ptr) {
+  __libc_free(ptr);
+}
@@ -0,0 +1,48 @@
+#ifndef bench_h
+#define bench_h
+
+/*
+Host benchmarks harness. Each benchmark runs in a process of its own, as the tests do, and prints its figures as csv
+lines (see bench_main.cpp for the columns). Allocations are counted by wrapping malloc, wich operator new goes through.
+*/
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+
+typedef void (*BenchFunction)();
+
+struct BenchCase {
+    BenchCase(const char* name, BenchFunction function);
+
+    const char*     name;
+    BenchFunction   function;
+    BenchCase*      next;
+};
+
+#define BENCH(name) \
+    static void name(); \
+    static BenchCase name##Case(#name, name); \
+    static void name()
+
+// Heap calls made while counting is on. Volatile, as compilers take malloc as not touching the program globals.
+namespace alloc {
+    extern volatile bool    counting;
+    extern volatile size_t  count;
+    extern volatile size_t  bytes;
+
+    inline void    start() { count = 0; bytes = 0; counting = true; }
+    inline void    stop() { counting = false; }
+}
+
+// Wall clock, the fake one (millis) is driven by the benchmarks
+inline uint64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs the function in a process of its own, so the module globals start fresh. Returns false if it failed.
+bool isolated(void (*function)(unsigned, unsigned), unsigned a, unsigned b);
+
+// Prints a csv line. loopsPerSec is left empty when negative.
+void report(const char* bench, const char* variant, unsigned channels, unsigned operations, uint64_t nanos, double loopsPerSec);
+
+#endif
@@ -0,0 +1,83 @@
+#include <ESPDomotic.h>
+#include <ESPConfig.h>
+#include "bench.h"
+
+/*
+Command path cost: commands injected through the loopback transport and handled by the module loop, one per loop
+iteration, for 1 to MAX_CHANNELS channels and each message mix. The idle mix runs the loop with no messages, as a
+baseline. The fake clock moves a milli per iteration, so batched settings saves and timers get their share.
+*/
+enum Mix { MIX_IDLE, MIX_STATE, MIX_TIMER, MIX_RENAME, MIX_ENABLE, MIX_COUNT };
+
+static const char*      MIX_NAMES[]     = {"idle", "state", "timer", "rename", "enable"};
+static const char*      MIX_SUFFIXES[]  = {NULL, "command/state", "command/timer", "command/rename", "command/enable"};
+static const uint8_t    PINS[]          = {5, 4, 12, 13, 14, 15, 0, 2};
+static const unsigned   MESSAGES        = 5000;
+static const char       PREFIX[]        = "generic/home/lights/";
+
+static void measureCommands(unsigned channelsCount, unsigned mix) {
+  static char ids[MAX_CHANNELS][12];
+  static char names[2][MAX_CHANNELS][16];
+  static char topics[2][MAX_CHANNELS][300];
+  ESPDomotic module;
+  LoopbackTransport loopback;
+  for (unsigned i = 0; i < channelsCount; ++i) {
+    snprintf(ids[i], sizeof(ids[i]), "C%u", i);
+    snprintf(names[0][i], sizeof(names[0][i]), "ch%u", i);
+    snprintf(names[1][i], sizeof(names[1][i]), "rn%u", i);
+    module.addChannel(new Channel(ids[i], names[0][i], PINS[i % sizeof(PINS)], OUTPUT, HIGH));
+    for (unsigned n = 0; n < 2; ++n) {
+      snprintf(topics[n][i], sizeof(topics[n][i]), "%s%s/%s", PREFIX, names[n][i], mix == MIX_IDLE ? "" : MIX_SUFFIXES[mix]);
+    }
+  }
+  WiFi.fakeStatus = WL_DISCONNECTED;
+  ESPConfig::portalConnects = false;
+  ESPConfig::portalValues = {{"moduleLocation", "home"}, {"moduleName", "lights"}};
+  module.setTransport(&loopback);
+  module.init();
+  module.loop();
+  if (!loopback.connected()) {
+    exit(1);
+  }
+  alloc::start();
+  uint64_t start = nowNanos();
+  for (unsigned m = 0; m < MESSAGES; ++m) {
+    unsigned channel = m % channelsCount;
+    // Each channel alternates the value it gets, so every command changes something
+    bool odd = (m / channelsCount) % 2;
+    const char* payload = NULL;
+    switch (mix) {
+      case MIX_STATE:
+      case MIX_ENABLE:
+        payload = odd ? "0" : "1";
+        break;
+      case MIX_TIMER:
+        payload = odd ? "700" : "600";
+        break;
+      case MIX_RENAME:
+        payload = names[odd ? 0 : 1][channel];
+        break;
+    }
+    if (payload && !loopback.inject(topics[mix == MIX_RENAME && odd ? 1 : 0][channel], (const uint8_t*) payload, strlen(payload))) {
+      exit(1);
+    }
+    module.loop();
+    fake::advance(1);
+  }
+  uint64_t elapsed = nowNanos() - start;
+  alloc::stop();
+  if (loopback.dropped > 0) {
+    exit(1);
+  }
+  report("commands", MIX_NAMES[mix], channelsCount, MESSAGES, elapsed, MESSAGES * 1e9 / (elapsed ? elapsed : 1));
+}
+
+BENCH(commands) {
+  for (unsigned mix = 0; mix < MIX_COUNT; ++mix) {
+    for (unsigned channels = 1; channels <= MAX_CHANNELS; ++channels) {
+      if (!isolated(measureCommands, channels, mix)) {
+        exit(1);
+      }
+    }
+  }
+}
@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bench.h"
+
+static BenchCase*   _firstBench = NULL;
+static BenchCase*   _lastBench  = NULL;
+
+BenchCase::BenchCase(const char* name, BenchFunction function) : name(name), function(function), next(NULL) {
+  if (_lastBench) {
+    _lastBench->next = this;
+  } else {
+    _firstBench = this;
+  }
+  _lastBench = this;
+}
+
+void report(const char* bench, const char* variant, unsigned channels, unsigned operations, uint64_t nanos, double loopsPerSec) {
+  double ops = operations ? operations : 1;
+  printf("%s,%s,%u,%u,%.2f,%.1f,%.0f,", bench, variant, channels, operations, (size_t) alloc::count / ops, (size_t) alloc::bytes / ops, nanos / ops);
+  if (loopsPerSec >= 0) {
+    printf("%.0f", loopsPerSec);
+  }
+  printf("\n");
+  fflush(stdout);
+}
+
+bool isolated(void (*function)(unsigned, unsigned), unsigned a, unsigned b) {
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    function(a, b);
+    exit(0);
+  }
+  int status = 0;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static BenchCase*   _running    = NULL;
+
+static void runBench(unsigned, unsigned) {
+  _running->function();
+}
+
+static bool isSelected(int argc, char** argv, const char* name) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return argc <= 1;
+}
+
+// Runs the benchmarks named in the arguments, all of them if none, printing a csv table
+int main(int argc, char** argv) {
+  // The counting hook must be in place, or every figure would read as allocation free
+  alloc::start();
+  void* volatile probe = malloc(1);
+  free(probe);
+  alloc::stop();
+  if (alloc::count != 1) {
+    fprintf(stderr, "malloc is not being counted (%zu)\n", (size_t) alloc::count);
+    return 1;
+  }
+  printf("bench,variant,channels,operations,allocs_per_op,bytes_per_op,ns_per_op,loops_per_sec\n");
+  int failed = 0;
+  for (BenchCase* bench = _firstBench; bench; bench = bench->next) {
+    if (!isSelected(argc, argv, bench->name)) {
+      continue;
+    }
+    _running = bench;
+    if (!isolated(runBench, 0, 0)) {
+      fprintf(stderr, "%s failed\n", bench->name);
+      ++failed;
+    }
+  }
+  return failed ? 1 : 0;
+}
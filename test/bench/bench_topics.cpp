@@ -0,0 +1,52 @@
+#include <ESPDomotic.h>
+#include <ESPConfig.h>
+#include "bench.h"
+
+/*
+Topic building cost: the String overloads (kept for compatibility) against the ones writing into a caller buffer.
+*/
+static const unsigned   CALLS   = 100000;
+static volatile size_t  _sink   = 0;
+
+enum TopicVariant { STATION_STRING, STATION_BUFFER, CHANNEL_STRING, CHANNEL_BUFFER, VARIANTS_COUNT };
+
+static const char*      VARIANT_NAMES[] = {"station_string", "station_buffer", "channel_string", "channel_buffer"};
+
+static void measureTopics(unsigned variant, unsigned) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  ESPConfig::portalValues = {{"moduleLocation", "home"}, {"moduleName", "lights"}, {"mqttHost", "10.0.0.1"}, {"mqttPort", "1883"}};
+  module.init();
+  module.loop();
+  char topic[_topicMaxLength];
+  alloc::start();
+  uint64_t start = nowNanos();
+  for (unsigned i = 0; i < CALLS; ++i) {
+    switch (variant) {
+      case STATION_STRING:
+        _sink = _sink + module.getStationTopic("feedback/states").length();
+        break;
+      case STATION_BUFFER:
+        _sink = _sink + module.getStationTopic("feedback/states", topic, sizeof(topic));
+        break;
+      case CHANNEL_STRING:
+        _sink = _sink + module.getChannelTopic(&channel, "feedback/state").length();
+        break;
+      default:
+        _sink = _sink + module.getChannelTopic(&channel, "feedback/state", topic, sizeof(topic));
+        break;
+    }
+  }
+  uint64_t elapsed = nowNanos() - start;
+  alloc::stop();
+  report("topics", VARIANT_NAMES[variant], 1, CALLS, elapsed, -1);
+}
+
+BENCH(topics) {
+  for (unsigned variant = 0; variant < VARIANTS_COUNT; ++variant) {
+    if (!isolated(measureTopics, variant, 0)) {
+      exit(1);
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#ifndef fixture_h
+#define fixture_h
+
+#include <ESPDomotic.h>
+#include <ESPConfig.h>
+#include <LittleFS.h>
+#include "test.h"
+
+#define TOPIC_PREFIX "generic/home/lights/"
+
+/*
+Boots the module as configured through the portal (type generic, location home, name lights) and runs a loop
+iteration, so it gets connected to the fake broker.
+*/
+inline PubSubClient& startModule(ESPDomotic& module) {
+    ESPConfig::portalValues = {
+        {"moduleLocation", "home"},
+        {"moduleName", "lights"},
+        {"mqttHost", "10.0.0.1"},
+        {"mqttPort", "1883"}
+    };
+    module.init();
+    module.loop();
+    return *module.getMqttClient();
+}
+
+// Tells if the client was subscribed to the topic
+inline bool isSubscribed(PubSubClient& client, const std::string& topic) {
+    for (const std::string& subscription : client.subscriptions) {
+        if (subscription == topic) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Times the topic was published
+inline size_t publishedCount(PubSubClient& client, const std::string& topic) {
+    size_t count = 0;
+    for (const PubSubClient::Message& message : client.published) {
+        if (message.topic == topic) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+// Runs the loop in 100 millis steps until the module tries to connect again. Returns the millis waited.
+inline uint32_t waitConnectAttempt(ESPDomotic& module, PubSubClient& client) {
+    unsigned attempts = client.connectAttempts;
+    uint32_t waited = 0;
+    while (client.connectAttempts == attempts && waited <= _mqtt_reconnection_max_wait_millis + 1000) {
+        fake::advance(100);
+        waited += 100;
+        module.loop();
+    }
+    return waited;
+}
+
+#endif
@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "test.h"
+
+static TestCase*    _firstTest  = NULL;
+static TestCase*    _lastTest   = NULL;
+
+TestCase::TestCase(const char* name, TestFunction function) : name(name), function(function), next(NULL) {
+  if (_lastTest) {
+    _lastTest->next = this;
+  } else {
+    _firstTest = this;
+  }
+  _lastTest = this;
+}
+
+void failTest(const char* file, int line, const char* expression) {
+  fprintf(stderr, "%s:%d: CHECK(%s) failed\n", file, line, expression);
+  exit(1);
+}
+
+static bool isSelected(int argc, char** argv, const char* name) {
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], name) == 0) {
+      return true;
+    }
+  }
+  return argc <= 1;
+}
+
+// Runs the tests named in the arguments, all of them if none
+int main(int argc, char** argv) {
+  int run = 0;
+  int failed = 0;
+  for (TestCase* test = _firstTest; test; test = test->next) {
+    if (!isSelected(argc, argv, test->name)) {
+      continue;
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      test->function();
+      exit(0);
+    }
+    int status = 0;
+    bool passed = pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("%s %s\n", passed ? "PASS" : "FAIL", test->name);
+    ++run;
+    failed += passed ? 0 : 1;
+  }
+  printf("%d tests, %d failed\n", run, failed);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,224 @@
+#include <Arduino.h>
+#include <ESP8266mDNS.h>
+
+namespace fake {
+    uint32_t        now             = 0;
+    uint32_t        freeHeap        = 40000;
+    uint32_t        maxFreeBlock    = 30000;
+    unsigned        restarts        = 0;
+    std::string     serial;
+}
+
+struct FakePin {
+    uint8_t     mode;
+    uint8_t     level;
+    unsigned    writes;
+    void        (*handler)(void*);
+    void*       arg;
+};
+
+static FakePin      _pins[17];
+static uint32_t     _microsTicks    = 0;
+static uint32_t     _randomState    = 1;
+
+HardwareSerial      Serial;
+EspClass            ESP;
+ESP8266WiFiClass    WiFi;
+MDNSResponder       MDNS;
+GpioRegister        GPOS = { true, 0 };
+GpioRegister        GPOC = { false, 0 };
+
+unsigned long millis() {
+  return fake::now;
+}
+
+unsigned long micros() {
+  // Each call takes a micro, so loops are never measured as free
+  return (uint32_t) (fake::now * 1000 + ++_microsTicks);
+}
+
+void delay(unsigned long ms) {
+  fake::now += ms;
+}
+
+void yield() {
+}
+
+long random(long max) {
+  _randomState = _randomState * 1103515245 + 12345;
+  return max > 0 ? (long) ((_randomState >> 1) % max) : 0;
+}
+
+long random(long min, long max) {
+  return min + random(max - min);
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  _pins[pin].mode = mode;
+  if (mode == INPUT_PULLUP) {
+    _pins[pin].level = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t value) {
+  _pins[pin].level = value ? HIGH : LOW;
+  ++_pins[pin].writes;
+}
+
+int digitalRead(uint8_t pin) {
+  return _pins[pin].level;
+}
+
+void attachInterruptArg(uint8_t pin, void (*handler)(void*), void* arg, int) {
+  _pins[pin].handler = handler;
+  _pins[pin].arg = arg;
+}
+
+void detachInterrupt(uint8_t pin) {
+  _pins[pin].handler = NULL;
+}
+
+GpioRegister& GpioRegister::operator=(uint32_t mask) {
+  written |= mask;
+  for (uint8_t pin = 0; pin < 16; ++pin) {
+    if (mask & (1UL << pin)) {
+      _pins[pin].level = set ? HIGH : LOW;
+    }
+  }
+  return *this;
+}
+
+uint8_t fake::pinMode(uint8_t pin) {
+  return _pins[pin].mode;
+}
+
+uint8_t fake::pinLevel(uint8_t pin) {
+  return _pins[pin].level;
+}
+
+unsigned fake::pinWrites(uint8_t pin) {
+  return _pins[pin].writes;
+}
+
+void fake::setPin(uint8_t pin, uint8_t level) {
+  if (_pins[pin].level == level) {
+    return;
+  }
+  _pins[pin].level = level;
+  if (_pins[pin].handler) {
+    _pins[pin].handler(_pins[pin].arg);
+  }
+}
+
+void fake::advance(uint32_t ms) {
+  now += ms;
+}
+
+void String::toCharArray(char* buff, unsigned int size) const {
+  if (size == 0) {
+    return;
+  }
+  strncpy(buff, _s.c_str(), size - 1);
+  buff[size - 1] = '\0';
+}
+
+void String::trim() {
+  size_t start = _s.find_first_not_of(" \t\r\n");
+  size_t end = _s.find_last_not_of(" \t\r\n");
+  _s = start == std::string::npos ? "" : _s.substr(start, end - start + 1);
+}
+
+size_t Print::write(const uint8_t* buff, size_t size) {
+  size_t n = 0;
+  while (n < size && write(buff[n])) {
+    ++n;
+  }
+  return n;
+}
+
+size_t Print::print(long v, int base) {
+  if (v < 0 && base == DEC) {
+    return print('-') + print((unsigned long) -v, base);
+  }
+  return print((unsigned long) v, base);
+}
+
+size_t Print::print(unsigned long v, int base) {
+  char buff[24];
+  snprintf(buff, sizeof(buff), base == HEX ? "%lX" : "%lu", v);
+  return write(buff);
+}
+
+size_t Print::print(double v, int digits) {
+  char buff[32];
+  snprintf(buff, sizeof(buff), "%.*f", digits, v);
+  return write(buff);
+}
+
+size_t Print::vprintf(const char* format, va_list args) {
+  char buff[256];
+  int length = vsnprintf(buff, sizeof(buff), format, args);
+  if (length < 0) {
+    return 0;
+  }
+  return write((const uint8_t*) buff, (size_t) length < sizeof(buff) ? length : sizeof(buff) - 1);
+}
+
+size_t Print::printf(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+size_t Print::printf_P(const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t n = vprintf(format, args);
+  va_end(args);
+  return n;
+}
+
+size_t Stream::readBytes(char* buff, size_t size) {
+  size_t n = 0;
+  int c;
+  while (n < size && (c = read()) >= 0) {
+    buff[n++] = c;
+  }
+  return n;
+}
+
+String Stream::readStringUntil(char terminator) {
+  std::string s;
+  int c;
+  while ((c = read()) >= 0 && c != terminator) {
+    s += (char) c;
+  }
+  return String(s);
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+  fake::serial += (char) c;
+  return 1;
+}
+
+size_t IPAddress::printTo(Print& p) const {
+  return p.printf("%u.%u.%u.%u", _bytes[0], _bytes[1], _bytes[2], _bytes[3]);
+}
+
+uint32_t EspClass::getFreeHeap() {
+  return fake::freeHeap;
+}
+
+uint32_t EspClass::getMaxFreeBlockSize() {
+  return fake::maxFreeBlock;
+}
+
+uint8_t EspClass::getHeapFragmentation() {
+  return fake::freeHeap ? 100 - fake::maxFreeBlock * 100 / fake::freeHeap : 0;
+}
+
+void EspClass::restart() {
+  ++fake::restarts;
+}
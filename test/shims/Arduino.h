@@ -0,0 +1,215 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/*
+Host shim of the ESP8266 Arduino core, with just what the lib uses. Time, pins and heap are fakes the tests drive
+through the fake namespace.
+*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <functional>
+#include <string>
+
+#define LOW             0x0
+#define HIGH            0x1
+#define INPUT           0x00
+#define OUTPUT          0x01
+#define INPUT_PULLUP    0x02
+#define RISING          0x01
+#define FALLING         0x02
+#define CHANGE          0x03
+#define DEC             10
+#define HEX             16
+
+#define D0  16
+#define D1  5
+#define D2  4
+#define D3  0
+#define D4  2
+#define D5  14
+#define D6  12
+#define D7  13
+#define D8  15
+
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+#define PROGMEM
+#define PGM_P               const char*
+#define PSTR(s)             (s)
+#define F(s)                (reinterpret_cast<const __FlashStringHelper*>(s))
+#define FPSTR(p)            (reinterpret_cast<const __FlashStringHelper*>(p))
+#define NOT_AN_INTERRUPT    -1
+#define digitalPinToInterrupt(p)    ((p) < 16 ? (p) : NOT_AN_INTERRUPT)
+
+class __FlashStringHelper;
+typedef bool boolean;
+
+unsigned long   millis();
+unsigned long   micros();
+void            delay(unsigned long ms);
+void            yield();
+long            random(long max);
+long            random(long min, long max);
+void            pinMode(uint8_t pin, uint8_t mode);
+void            digitalWrite(uint8_t pin, uint8_t value);
+int             digitalRead(uint8_t pin);
+void            attachInterruptArg(uint8_t pin, void (*handler)(void*), void* arg, int mode);
+void            detachInterrupt(uint8_t pin);
+
+// GPIO0-15 set (GPOS) and clear (GPOC) registers. Writing a mask drives the pins at once.
+struct GpioRegister {
+    bool            set;
+    // Host fake: the pins driven through the register, all the masks written or-ed
+    uint32_t        written;
+    GpioRegister&   operator=(uint32_t mask);
+};
+extern GpioRegister GPOS;
+extern GpioRegister GPOC;
+
+class String {
+    public:
+        String() {}
+        String(const char* s) : _s(s ? s : "") {}
+        String(const __FlashStringHelper* s) : _s(reinterpret_cast<const char*>(s)) {}
+        String(const std::string& s) : _s(s) {}
+        explicit String(char c) : _s(1, c) {}
+        explicit String(unsigned char v) : _s(std::to_string(v)) {}
+        explicit String(int v) : _s(std::to_string(v)) {}
+        explicit String(unsigned int v) : _s(std::to_string(v)) {}
+        explicit String(long v) : _s(std::to_string(v)) {}
+        explicit String(unsigned long v) : _s(std::to_string(v)) {}
+
+        const char* c_str() const { return _s.c_str(); }
+        unsigned int length() const { return _s.size(); }
+        bool    equals(const String& s) const { return _s == s._s; }
+        bool    startsWith(const String& s) const { return _s.compare(0, s._s.size(), s._s) == 0; }
+        bool    endsWith(const String& s) const { return _s.size() >= s._s.size() && _s.compare(_s.size() - s._s.size(), s._s.size(), s._s) == 0; }
+        int     indexOf(char c) const { size_t i = _s.find(c); return i == std::string::npos ? -1 : (int) i; }
+        String  substring(unsigned int from, unsigned int to) const { return String(_s.substr(from, to - from)); }
+        long    toInt() const { return atol(_s.c_str()); }
+        void    toCharArray(char* buff, unsigned int size) const;
+        void    trim();
+        bool    concat(const String& s) { _s += s._s; return true; }
+        bool    concat(const char* s) { _s += s; return true; }
+        bool    operator==(const String& s) const { return _s == s._s; }
+        String& operator+=(const String& s) { _s += s._s; return *this; }
+        char    operator[](unsigned int i) const { return _s[i]; }
+
+    private:
+        std::string _s;
+};
+
+inline String operator+(const String& a, const String& b) { String r(a); r += b; return r; }
+inline String operator+(const String& a, const char* b) { String r(a); r += String(b); return r; }
+inline String operator+(const char* a, const String& b) { String r(a); r += b; return r; }
+
+class Print;
+
+class Printable {
+    public:
+        virtual ~Printable() {}
+        virtual size_t printTo(Print& p) const = 0;
+};
+
+class Print {
+    public:
+        virtual ~Print() {}
+
+        virtual size_t  write(uint8_t c) = 0;
+        virtual size_t  write(const uint8_t* buff, size_t size);
+        size_t  write(const char* s) { return write((const uint8_t*) s, strlen(s)); }
+
+        size_t  print(const __FlashStringHelper* s) { return write(reinterpret_cast<const char*>(s)); }
+        size_t  print(const char* s) { return write(s); }
+        size_t  print(const String& s) { return write(s.c_str()); }
+        size_t  print(const Printable& p) { return p.printTo(*this); }
+        size_t  print(char c) { return write((uint8_t) c); }
+        size_t  print(unsigned char v, int base = DEC) { return print((unsigned long) v, base); }
+        size_t  print(int v, int base = DEC) { return print((long) v, base); }
+        size_t  print(unsigned int v, int base = DEC) { return print((unsigned long) v, base); }
+        size_t  print(long v, int base = DEC);
+        size_t  print(unsigned long v, int base = DEC);
+        size_t  print(double v, int digits = 2);
+
+        template <class T> size_t println(T v) { size_t n = print(v); return n + println(); }
+        size_t  println() { return write("\r\n"); }
+
+        size_t  printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+        size_t  printf_P(const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+        int     getWriteError() { return _writeError; }
+        void    clearWriteError() { _writeError = 0; }
+
+    protected:
+        void    setWriteError(int error = 1) { _writeError = error; }
+
+    private:
+        int     _writeError = 0;
+        size_t  vprintf(const char* format, va_list args);
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() { return 0; }
+        virtual int read() { return -1; }
+        virtual int peek() { return -1; }
+        void    setTimeout(unsigned long) {}
+        size_t  readBytes(char* buff, size_t size);
+        size_t  readBytes(uint8_t* buff, size_t size) { return readBytes((char*) buff, size); }
+        String  readStringUntil(char terminator);
+};
+
+// Output is kept in the fake serial buffer, so tests can look at the logs
+class HardwareSerial : public Stream {
+    public:
+        void    begin(unsigned long) {}
+        size_t  write(uint8_t c) override;
+        using Print::write;
+};
+extern HardwareSerial Serial;
+
+class IPAddress : public Printable {
+    public:
+        IPAddress() : IPAddress(0, 0, 0, 0) {}
+        IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : _bytes{a, b, c, d} {}
+        size_t  printTo(Print& p) const override;
+
+    private:
+        uint8_t _bytes[4];
+};
+
+class EspClass {
+    public:
+        uint32_t    getChipId() { return 0x00C0FFEE; }
+        uint32_t    getFreeHeap();
+        uint32_t    getMaxFreeBlockSize();
+        uint8_t     getHeapFragmentation();
+        void        restart();
+};
+extern EspClass ESP;
+
+/* Host fakes control */
+namespace fake {
+    // Millis returned by millis(), wrapping at 32 bits as on the device
+    extern uint32_t     now;
+    extern uint32_t     freeHeap;
+    extern uint32_t     maxFreeBlock;
+    extern unsigned     restarts;
+    extern std::string  serial;
+
+    uint8_t     pinMode(uint8_t pin);
+    uint8_t     pinLevel(uint8_t pin);
+    // Times the pin was driven through digitalWrite
+    unsigned    pinWrites(uint8_t pin);
+    // Drives an input pin from outside, firing its interrupt handler if it changes
+    void        setPin(uint8_t pin, uint8_t level);
+    void        advance(uint32_t ms);
+}
+
+#include <ESP8266WiFi.h>
+
+#endif
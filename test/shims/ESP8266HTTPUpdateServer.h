@@ -0,0 +1,11 @@
+#ifndef ESP8266HTTPUpdateServer_h
+#define ESP8266HTTPUpdateServer_h
+
+#include <ESP8266WebServer.h>
+
+class ESP8266HTTPUpdateServer {
+    public:
+        void    setup(ESP8266WebServer*) {}
+};
+
+#endif
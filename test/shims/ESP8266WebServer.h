@@ -0,0 +1,13 @@
+#ifndef ESP8266WebServer_h
+#define ESP8266WebServer_h
+
+#include <Arduino.h>
+
+class ESP8266WebServer {
+    public:
+        ESP8266WebServer(int) {}
+        void    begin() {}
+        void    handleClient() {}
+};
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef ESP8266WiFi_h
+#define ESP8266WiFi_h
+
+#include <Arduino.h>
+
+enum wl_status_t {
+    WL_IDLE_STATUS,
+    WL_NO_SSID_AVAIL,
+    WL_SCAN_COMPLETED,
+    WL_CONNECTED,
+    WL_CONNECT_FAILED,
+    WL_CONNECTION_LOST,
+    WL_DISCONNECTED
+};
+
+enum WiFiMode_t {
+    WIFI_OFF,
+    WIFI_STA,
+    WIFI_AP,
+    WIFI_AP_STA
+};
+
+class Client : public Stream {
+    public:
+        size_t  write(uint8_t) override { return 1; }
+        using Print::write;
+};
+
+class WiFiClient : public Client {
+    public:
+        void    setTimeout(unsigned long) {}
+};
+
+class ESP8266WiFiClass {
+    public:
+        bool        mode(WiFiMode_t m) { wifiMode = m; return true; }
+        wl_status_t begin() { ++begins; return fakeStatus; }
+        wl_status_t status() { return fakeStatus; }
+        bool        disconnect(bool = false) { return true; }
+        IPAddress   localIP() { return IPAddress(10, 0, 0, 2); }
+
+        /* Host fakes */
+        wl_status_t fakeStatus  = WL_CONNECTED;
+        WiFiMode_t  wifiMode    = WIFI_OFF;
+        unsigned    begins      = 0;
+};
+extern ESP8266WiFiClass WiFi;
+
+#endif
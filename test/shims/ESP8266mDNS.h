@@ -0,0 +1,13 @@
+#ifndef ESP8266mDNS_h
+#define ESP8266mDNS_h
+
+#include <Arduino.h>
+
+class MDNSResponder {
+    public:
+        bool    begin(const char*) { return true; }
+        void    addService(const char*, const char*, uint16_t) {}
+};
+extern MDNSResponder MDNS;
+
+#endif
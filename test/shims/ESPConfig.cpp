@@ -0,0 +1,23 @@
+#include <ESPConfig.h>
+
+std::map<std::string, std::string>  ESPConfig::portalValues;
+bool                                ESPConfig::portalConnects       = true;
+unsigned                            ESPConfig::portalRuns           = 0;
+uint8_t                             ESPConfig::minimumSignalQuality = 0;
+
+bool ESPConfig::connectWifiNetwork(bool) {
+  ++portalRuns;
+  if (portalValues.empty()) {
+    return portalConnects;
+  }
+  for (ESPConfigParam* param : _params) {
+    auto it = portalValues.find(param->getName());
+    if (it != portalValues.end()) {
+      param->updateValue(it->second.c_str());
+    }
+  }
+  if (_saveConfigCallback) {
+    _saveConfigCallback();
+  }
+  return portalConnects;
+}
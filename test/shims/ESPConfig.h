@@ -0,0 +1,54 @@
+#ifndef ESPConfig_h
+#define ESPConfig_h
+
+/*
+Host shim of ESPConfig. The portal is emulated: the values set in portalValues are taken as entered by the user
+and saved through the save config callback.
+*/
+#include <Arduino.h>
+#include <map>
+#include <vector>
+
+enum ParamType {
+    Text,
+    Combo
+};
+
+class ESPConfigParam {
+    public:
+        ESPConfigParam(ParamType, const char* name, const char*, const char* defaultValue, uint8_t, const char*) : _name(name), _value(defaultValue) {}
+
+        const char* getName() { return _name; }
+        const char* getValue() { return _value.c_str(); }
+        void        updateValue(const char* value) { _value = value ? value : ""; }
+
+    private:
+        const char*     _name;
+        std::string     _value;
+};
+
+class ESPConfig {
+    public:
+        void    addParameter(ESPConfigParam* param) { _params.push_back(param); }
+        void    setWifiConnectTimeout(uint16_t) {}
+        void    setConfigPortalTimeout(uint16_t) {}
+        void    setAPStaticIP(IPAddress, IPAddress, IPAddress) {}
+        void    setPortalSSID(const char*) {}
+        void    setMinimumSignalQuality(uint8_t quality) { minimumSignalQuality = quality; }
+        void    setStationNameCallback(std::function<const char*()>) {}
+        void    setSaveConfigCallback(std::function<void()> callback) { _saveConfigCallback = callback; }
+        void    setFeedbackPin(uint8_t) {}
+        bool    connectWifiNetwork(bool existsConfig);
+
+        /* Host fakes */
+        static std::map<std::string, std::string>   portalValues;
+        static bool                                 portalConnects;
+        static unsigned                             portalRuns;
+        static uint8_t                              minimumSignalQuality;
+
+    private:
+        std::vector<ESPConfigParam*>    _params;
+        std::function<void()>           _saveConfigCallback;
+};
+
+#endif
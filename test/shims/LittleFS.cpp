@@ -0,0 +1,122 @@
+#include <LittleFS.h>
+
+FS LittleFS;
+
+File::File(std::shared_ptr<FileData> data, bool writable, bool append) : _data(data), _writable(writable), _append(append) {
+}
+
+size_t File::write(uint8_t c) {
+  return write(&c, 1);
+}
+
+size_t File::write(const uint8_t* buff, size_t size) {
+  if (!_data || !_writable) {
+    setWriteError();
+    return 0;
+  }
+  if (LittleFS.writeBudget >= 0 && (long) size > LittleFS.writeBudget) {
+    size = LittleFS.writeBudget;
+    setWriteError();
+  }
+  if (LittleFS.writeBudget >= 0) {
+    LittleFS.writeBudget -= size;
+  }
+  if (_append) {
+    _pos = _data->size();
+  }
+  if (_pos + size > _data->size()) {
+    _data->resize(_pos + size);
+  }
+  memcpy(_data->data() + _pos, buff, size);
+  _pos += size;
+  return size;
+}
+
+int File::available() {
+  return _data && _pos < _data->size() ? _data->size() - _pos : 0;
+}
+
+int File::read() {
+  return available() ? (*_data)[_pos++] : -1;
+}
+
+int File::peek() {
+  return available() ? (*_data)[_pos] : -1;
+}
+
+size_t File::read(uint8_t* buff, size_t size) {
+  size_t n = available();
+  n = n < size ? n : size;
+  if (n > 0) {
+    memcpy(buff, _data->data() + _pos, n);
+    _pos += n;
+  }
+  return n;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+  if (!_data) {
+    return false;
+  }
+  size_t target = mode == SeekSet ? pos : mode == SeekCur ? _pos + pos : _data->size() + pos;
+  if (target > _data->size()) {
+    return false;
+  }
+  _pos = target;
+  return true;
+}
+
+bool FS::begin() {
+  ++mounts;
+  return true;
+}
+
+bool FS::format() {
+  files.clear();
+  return true;
+}
+
+bool FS::exists(const char* path) {
+  return files.count(path) > 0;
+}
+
+File FS::open(const char* path, const char* mode) {
+  ++opens;
+  auto it = files.find(path);
+  bool append = mode[0] == 'a';
+  bool writable = mode[0] != 'r' || mode[1] == '+';
+  if (it == files.end()) {
+    if (mode[0] == 'r') {
+      return File();
+    }
+    it = files.emplace(path, std::make_shared<FileData>()).first;
+  } else if (mode[0] == 'w') {
+    it->second->clear();
+  }
+  return File(it->second, writable, append);
+}
+
+bool FS::remove(const char* path) {
+  return files.erase(path) > 0;
+}
+
+bool FS::rename(const char* from, const char* to) {
+  auto it = files.find(from);
+  if (it == files.end() || failRenames) {
+    return false;
+  }
+  files[to] = it->second;
+  files.erase(from);
+  ++renames;
+  return true;
+}
+
+void FS::put(const char* path, const void* content, size_t size) {
+  const uint8_t* bytes = (const uint8_t*) content;
+  files[path] = std::make_shared<FileData>(bytes, bytes + size);
+}
+
+std::string FS::content(const char* path) {
+  auto it = files.find(path);
+  return it == files.end() ? std::string() : std::string(it->second->begin(), it->second->end());
+}
@@ -0,0 +1,72 @@
+#ifndef LittleFS_h
+#define LittleFS_h
+
+/*
+Host shim of the LittleFS file system, kept in memory. Files written can be looked at (and broken) through the
+files map, writeBudget emulates a power loss or a full flash in the middle of a write and failRenames a failed commit.
+*/
+#include <Arduino.h>
+#include <map>
+#include <memory>
+#include <vector>
+
+enum SeekMode {
+    SeekSet,
+    SeekCur,
+    SeekEnd
+};
+
+typedef std::vector<uint8_t> FileData;
+
+class File : public Stream {
+    public:
+        File() {}
+        File(std::shared_ptr<FileData> data, bool writable, bool append);
+
+        size_t  write(uint8_t c) override;
+        size_t  write(const uint8_t* buff, size_t size) override;
+        using Print::write;
+        int     available() override;
+        int     read() override;
+        int     peek() override;
+        size_t  read(uint8_t* buff, size_t size);
+        bool    seek(uint32_t pos, SeekMode mode = SeekSet);
+        size_t  position() const { return _pos; }
+        size_t  size() const { return _data ? _data->size() : 0; }
+        void    flush() {}
+        void    close() { _data.reset(); }
+        explicit operator bool() const { return (bool) _data; }
+
+    private:
+        std::shared_ptr<FileData>   _data;
+        size_t                      _pos        = 0;
+        bool                        _writable   = false;
+        bool                        _append     = false;
+};
+
+class FS {
+    public:
+        bool    begin();
+        bool    format();
+        bool    exists(const char* path);
+        File    open(const char* path, const char* mode);
+        bool    remove(const char* path);
+        bool    rename(const char* from, const char* to);
+
+        /* Host fakes */
+        std::map<std::string, std::shared_ptr<FileData>>   files;
+        // Bytes that can still be written, -1 for no limit
+        long        writeBudget = -1;
+        unsigned    mounts      = 0;
+        unsigned    opens       = 0;
+        // Files replaced through a rename, as the atomic writes commit
+        unsigned    renames     = 0;
+        // Set, renames fail leaving both files as they were
+        bool        failRenames = false;
+        // Writes content as the file, bypassing the module
+        void        put(const char* path, const void* content, size_t size);
+        std::string content(const char* path);
+};
+extern FS LittleFS;
+
+#endif
@@ -0,0 +1,125 @@
+#include <PubSubClient.h>
+
+PubSubClient& PubSubClient::setServer(const char* host, uint16_t port) {
+  this->host = host;
+  this->port = port;
+  return *this;
+}
+
+PubSubClient& PubSubClient::setCallback(MQTT_CALLBACK_SIGNATURE) {
+  _callback = callback;
+  return *this;
+}
+
+bool PubSubClient::connect(const char* id, const char*, const char*, const char* willTopic, uint8_t, bool, const char* willMessage, bool cleanSession) {
+  ++connectAttempts;
+  fake::advance(packetMillis);
+  if (!acceptConnections) {
+    _state = MQTT_CONNECT_FAILED;
+    return false;
+  }
+  clientId = id;
+  this->willTopic = willTopic ? willTopic : "";
+  this->willMessage = willMessage ? willMessage : "";
+  this->cleanSession = cleanSession;
+  if (cleanSession) {
+    subscriptions.clear();
+  }
+  _state = MQTT_CONNECTED;
+  return true;
+}
+
+void PubSubClient::disconnect() {
+  _state = MQTT_DISCONNECTED;
+}
+
+void PubSubClient::drop() {
+  _state = MQTT_CONNECTION_LOST;
+  if (!willTopic.empty()) {
+    published.push_back({ willTopic, willMessage, true });
+  }
+}
+
+bool PubSubClient::publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained) {
+  if (!connected() || !acceptPublishes || strlen(topic) + length + 7 > MQTT_MAX_PACKET_SIZE) {
+    return false;
+  }
+  fake::advance(packetMillis);
+  published.push_back({ topic, std::string((const char*) payload, length), retained });
+  return true;
+}
+
+bool PubSubClient::beginPublish(const char* topic, unsigned int, bool retained) {
+  if (!connected() || !acceptPublishes) {
+    return false;
+  }
+  _pending = { topic, "", retained };
+  return true;
+}
+
+size_t PubSubClient::write(uint8_t c) {
+  _pending.payload += (char) c;
+  return 1;
+}
+
+size_t PubSubClient::write(const uint8_t* buff, size_t size) {
+  _pending.payload.append((const char*) buff, size);
+  return size;
+}
+
+int PubSubClient::endPublish() {
+  if (!connected()) {
+    return 0;
+  }
+  fake::advance(packetMillis);
+  published.push_back(_pending);
+  return 1;
+}
+
+bool PubSubClient::subscribe(const char* topic, uint8_t) {
+  if (!connected()) {
+    return false;
+  }
+  ++subscribes;
+  fake::advance(packetMillis);
+  subscriptions.push_back(topic);
+  return true;
+}
+
+bool PubSubClient::unsubscribe(const char* topic) {
+  ++unsubscribes;
+  fake::advance(packetMillis);
+  for (auto it = subscriptions.begin(); it != subscriptions.end(); ++it) {
+    if (*it == topic) {
+      subscriptions.erase(it);
+      break;
+    }
+  }
+  return connected();
+}
+
+bool PubSubClient::loop() {
+  while (connected() && !incoming.empty()) {
+    Message message = incoming.front();
+    incoming.pop_front();
+    // As the real client, the topic is handed in its own buffer, wich publishing overwrites
+    snprintf(_buffer, sizeof(_buffer), "%s", message.topic.c_str());
+    if (_callback) {
+      _callback(_buffer, (uint8_t*) message.payload.data(), message.payload.size());
+    }
+  }
+  return connected();
+}
+
+void PubSubClient::deliver(const char* topic, const char* payload) {
+  incoming.push_back({ topic, payload, false });
+}
+
+const PubSubClient::Message* PubSubClient::lastPublished(const std::string& topic) const {
+  for (auto it = published.rbegin(); it != published.rend(); ++it) {
+    if (it->topic == topic) {
+      return &*it;
+    }
+  }
+  return NULL;
+}
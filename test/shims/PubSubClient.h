@@ -0,0 +1,80 @@
+#ifndef PubSubClient_h
+#define PubSubClient_h
+
+/*
+Host shim of PubSubClient 2.8. It talks to no broker: connections succeed while acceptConnections is set, what is
+published and subscribed gets recorded and the incoming messages are queued through deliver.
+*/
+#include <Arduino.h>
+#include <deque>
+#include <vector>
+
+#define MQTT_MAX_PACKET_SIZE        256
+
+#define MQTT_CONNECTION_TIMEOUT     -4
+#define MQTT_CONNECTION_LOST        -3
+#define MQTT_CONNECT_FAILED         -2
+#define MQTT_DISCONNECTED           -1
+#define MQTT_CONNECTED              0
+
+#define MQTT_CALLBACK_SIGNATURE std::function<void(char*, uint8_t*, unsigned int)> callback
+
+class PubSubClient : public Print {
+    public:
+        PubSubClient(Client&) {}
+
+        PubSubClient&   setServer(const char* host, uint16_t port);
+        PubSubClient&   setCallback(MQTT_CALLBACK_SIGNATURE);
+        PubSubClient&   setSocketTimeout(uint16_t) { return *this; }
+        bool    connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, bool willRetain, const char* willMessage, bool cleanSession);
+        void    disconnect();
+        bool    publish(const char* topic, const uint8_t* payload, unsigned int length, bool retained);
+        bool    beginPublish(const char* topic, unsigned int length, bool retained);
+        size_t  write(uint8_t c) override;
+        size_t  write(const uint8_t* buff, size_t size) override;
+        using Print::write;
+        int     endPublish();
+        bool    subscribe(const char* topic, uint8_t qos);
+        bool    unsubscribe(const char* topic);
+        bool    loop();
+        bool    connected() { return _state == MQTT_CONNECTED; }
+        int     state() { return _state; }
+
+        /* Host fakes */
+        struct Message {
+            std::string topic;
+            std::string payload;
+            bool        retained;
+        };
+        bool                        acceptConnections   = true;
+        // Cleared, publishing fails as when the connection breaks under the write
+        bool                        acceptPublishes     = true;
+        unsigned                    connectAttempts     = 0;
+        unsigned                    subscribes          = 0;
+        unsigned                    unsubscribes        = 0;
+        // Millis each packet sent takes, the fake clock is advanced by them
+        uint32_t                    packetMillis        = 0;
+        std::string                 host;
+        uint16_t                    port                = 0;
+        std::string                 clientId;
+        std::string                 willTopic;
+        std::string                 willMessage;
+        bool                        cleanSession        = true;
+        std::vector<std::string>    subscriptions;
+        std::vector<Message>        published;
+        std::deque<Message>         incoming;
+        // Queues a message from the broker, handed to the callback from loop()
+        void        deliver(const char* topic, const char* payload);
+        // The connection drops without a disconnect (the broker publishes the last will)
+        void        drop();
+        // The last message published on the topic, NULL if none
+        const Message*  lastPublished(const std::string& topic) const;
+
+    private:
+        int                         _state              = MQTT_DISCONNECTED;
+        std::function<void(char*, uint8_t*, unsigned int)> _callback;
+        Message                     _pending;
+        char                        _buffer[MQTT_MAX_PACKET_SIZE];
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef test_h
+#define test_h
+
+/*
+Minimal test harness. Each test runs in a process of its own, so the module globals, the fake clock and the in
+memory file system start fresh on every test.
+*/
+#include <stdio.h>
+
+typedef void (*TestFunction)();
+
+struct TestCase {
+    TestCase(const char* name, TestFunction function);
+
+    const char*     name;
+    TestFunction    function;
+    TestCase*       next;
+};
+
+// Fails the running test
+void failTest(const char* file, int line, const char* expression);
+
+#define TEST(name) \
+    static void name(); \
+    static TestCase name##Case(#name, name); \
+    static void name()
+
+#define CHECK(expression) \
+    do { if (!(expression)) { failTest(__FILE__, __LINE__, #expression); } } while (0)
+
+#endif
@@ -0,0 +1,110 @@
+#include "fixture.h"
+
+static const char CONF_FILE[] = "/conf.kv";
+
+static void fillValue(char* value, size_t length, char c) {
+  memset(value, c, length);
+  value[length] = '\0';
+}
+
+TEST(confRoundTripAcrossReboot) {
+  ESPDomotic module;
+  startModule(module);
+  char value[] = "first";
+  CHECK(module.updateConf("key", value));
+  char other[] = "second";
+  CHECK(module.updateConf("key", other));
+  char buff[16];
+  CHECK(module.getConf("key", buff, sizeof(buff)) == 6);
+  CHECK(strcmp(buff, "second") == 0);
+  // Booting again
+  ESPDomotic rebooted;
+  startModule(rebooted);
+  CHECK(rebooted.getConf("key", buff, sizeof(buff)) == 6);
+  CHECK(strcmp(buff, "second") == 0);
+}
+
+TEST(confFullIndexLeavesNoOrphanRecord) {
+  ESPDomotic module;
+  startModule(module);
+  char key[8];
+  char value[] = "v";
+  for (int i = 0; i < 16; ++i) {
+    snprintf(key, sizeof(key), "k%d", i);
+    CHECK(module.updateConf(key, value));
+  }
+  size_t fileSize = LittleFS.content(CONF_FILE).size();
+  CHECK(!module.updateConf("extra", value));
+  CHECK(LittleFS.content(CONF_FILE).size() == fileSize);
+  // Known keys can still be overwritten
+  char other[] = "w";
+  CHECK(module.updateConf("k3", other));
+  char buff[4];
+  CHECK(module.getConf("k3", buff, sizeof(buff)) == 1 && buff[0] == 'w');
+}
+
+TEST(confCompactsBeforeRunningOutOfOffsets) {
+  ESPDomotic module;
+  startModule(module);
+  static char value[1001];
+  // About 70KB of records, past the 16 bits offsets, with no loop() in between to compact
+  for (int i = 0; i < 70; ++i) {
+    fillValue(value, 1000, 'a' + i % 26);
+    CHECK(module.updateConf("big", value));
+  }
+  char* stored = module.getConf("big");
+  CHECK(stored && strlen(stored) == 1000 && stored[0] == 'a' + 69 % 26);
+  delete[] stored;
+  CHECK(LittleFS.content(CONF_FILE).size() < 0xFFFF);
+}
+
+TEST(confCompactionFailureBacksOff) {
+  ESPDomotic module;
+  startModule(module);
+  static char value[601];
+  for (int i = 0; i < 4; ++i) {
+    fillValue(value, 600, 'a' + i);
+    CHECK(module.updateConf("key", value));
+  }
+  size_t fileSize = LittleFS.content(CONF_FILE).size();
+  // Flash full, the compaction fails
+  LittleFS.writeBudget = 0;
+  module.loop();
+  unsigned opens = LittleFS.opens;
+  for (int i = 0; i < 50; ++i) {
+    fake::advance(10);
+    module.loop();
+  }
+  CHECK(LittleFS.opens == opens);
+  fake::advance(600);
+  module.loop();
+  CHECK(LittleFS.opens > opens);
+  // The wait grows after each failure
+  opens = LittleFS.opens;
+  fake::advance(1500);
+  module.loop();
+  CHECK(LittleFS.opens == opens);
+  LittleFS.writeBudget = -1;
+  fake::advance(600);
+  module.loop();
+  CHECK(LittleFS.content(CONF_FILE).size() < fileSize);
+  char* stored = module.getConf("key");
+  CHECK(stored && strlen(stored) == 600 && stored[0] == 'd');
+  delete[] stored;
+}
+
+TEST(confValueCopyOpensTheStoreOnce) {
+  ESPDomotic module;
+  startModule(module);
+  char value[] = "value";
+  CHECK(module.updateConf("key", value));
+  char empty[] = "";
+  CHECK(module.updateConf("empty", empty));
+  unsigned opens = LittleFS.opens;
+  char* stored = module.getConf("key");
+  CHECK(stored && strcmp(stored, "value") == 0);
+  delete[] stored;
+  CHECK(LittleFS.opens == opens + 1);
+  CHECK(module.getConf("empty") == NULL);
+  CHECK(module.getConf("missing") == NULL);
+}
@@ -0,0 +1,112 @@
+#include <ESPDomoticCore.h>
+#include "test.h"
+
+static const char PREFIX[] = "generic/home/lights/";
+
+TEST(dispatchesStationCommands) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"light"};
+  dispatcher.build(PREFIX, names, 1);
+  uint8_t channel = 99;
+  CHECK(dispatcher.resolve("generic/home/lights/command/hrst", &channel) == CMD_HARD_RESET);
+  CHECK(dispatcher.resolve("generic/home/lights/command/rst", &channel) == CMD_SOFT_RESET);
+  CHECK(dispatcher.resolve("generic/home/lights/command/states", &channel) == CMD_STATES);
+  CHECK(dispatcher.resolve("generic/home/lights/command/reboot", &channel) == CMD_UNKNOWN);
+  CHECK(channel == 99);
+}
+
+TEST(dispatchesChannelCommands) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"light", "fan", "light2", "heater"};
+  dispatcher.build(PREFIX, names, 4);
+  const char* commands[] = {"state", "enable", "timer", "rename"};
+  const MqttCommand expected[] = {CMD_STATE, CMD_ENABLE, CMD_TIMER, CMD_RENAME};
+  char topic[160];
+  for (uint8_t i = 0; i < 4; ++i) {
+    for (uint8_t c = 0; c < 4; ++c) {
+      snprintf(topic, sizeof(topic), "%s%s/command/%s", PREFIX, names[i], commands[c]);
+      uint8_t channel = 99;
+      CHECK(dispatcher.resolve(topic, &channel) == expected[c]);
+      CHECK(channel == i);
+    }
+  }
+}
+
+TEST(rejectsTopicsOutOfTheTable) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"light", "fan"};
+  uint8_t channel = 99;
+  // Nothing is resolved before the table is built
+  CHECK(dispatcher.resolve("generic/home/lights/light/command/state", &channel) == CMD_UNKNOWN);
+  dispatcher.build(PREFIX, names, 2);
+  CHECK(dispatcher.resolve("generic/home/other/light/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/lamp/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/ligh/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/lightx/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/light/command/state/x", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/light/feedback/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/light/command/", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/light", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights//command/state", &channel) == CMD_UNKNOWN);
+  CHECK(channel == 99);
+}
+
+TEST(rebuildFollowsRenames) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"light", "fan"};
+  dispatcher.build(PREFIX, names, 2);
+  names[1] = "ceiling";
+  dispatcher.build(PREFIX, names, 2);
+  uint8_t channel = 99;
+  CHECK(dispatcher.resolve("generic/home/lights/fan/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/ceiling/command/state", &channel) == CMD_STATE);
+  CHECK(channel == 1);
+}
+
+TEST(tellsStationCommandsFromChannelNamedCommand) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"light", "command"};
+  dispatcher.build(PREFIX, names, 2);
+  uint8_t channel = 99;
+  CHECK(dispatcher.resolve("generic/home/lights/command/rst", &channel) == CMD_SOFT_RESET);
+  CHECK(dispatcher.resolve("generic/home/lights/command/command/timer", &channel) == CMD_TIMER);
+  CHECK(channel == 1);
+}
+
+TEST(skipsUnnamedAndRepeatedChannels) {
+  TopicDispatcher dispatcher;
+  const char* names[] = {"", "light", "light", "a/b"};
+  dispatcher.build(PREFIX, names, 4);
+  uint8_t channel = 99;
+  CHECK(dispatcher.resolve("generic/home/lights/light/command/state", &channel) == CMD_STATE);
+  CHECK(channel == 1);
+  CHECK(dispatcher.resolve("generic/home/lights/a/command/state", &channel) == CMD_UNKNOWN);
+  CHECK(dispatcher.resolve("generic/home/lights/a/b/command/state", &channel) == CMD_UNKNOWN);
+}
+
+TEST(resolvesWithCollidingSlots) {
+  TopicDispatcher dispatcher;
+  // Every name of the table is resolved whatever the slots they hash to
+  char names[MAX_CHANNELS][12];
+  const char* pointers[MAX_CHANNELS];
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    snprintf(names[i], sizeof(names[i]), "ch%u", i);
+    pointers[i] = names[i];
+  }
+  dispatcher.build(PREFIX, pointers, MAX_CHANNELS);
+  char topic[160];
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    snprintf(topic, sizeof(topic), "%s%s/command/enable", PREFIX, names[i]);
+    uint8_t channel = 99;
+    CHECK(dispatcher.resolve(topic, &channel) == CMD_ENABLE);
+    CHECK(channel == i);
+  }
+}
+
+TEST(fnv1aFoldedTo16Bits) {
+  // FNV-1a 32 bits of "a" is 0xE40C292C
+  CHECK(fnv1a16("a", 1) == (0xE40C ^ 0x292C));
+  CHECK(fnv1a16("", 0) == (0x811C ^ 0x9DC5));
+  CHECK(fnv1a16("light/command", 5) == fnv1a16("light", 5));
+}
@@ -0,0 +1,120 @@
+#include "fixture.h"
+
+TEST(inputBounceRestartsDebounce) {
+  ESPDomotic module;
+  Channel button("B", "button", 4, INPUT, HIGH);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&button);
+  module.addChannel(&light);
+  module.bindInputChannel(&button, &light);
+  fake::setPin(4, HIGH);
+  startModule(module);
+  fake::setPin(4, LOW);
+  fake::advance(30);
+  module.loop();
+  // It bounces before being stable, so the wait starts over from the last edge
+  fake::setPin(4, HIGH);
+  fake::setPin(4, LOW);
+  fake::advance(30);
+  module.loop();
+  CHECK(button.state == HIGH);
+  CHECK(fake::pinLevel(5) == HIGH);
+  fake::advance(20);
+  module.loop();
+  CHECK(button.state == LOW);
+  CHECK(fake::pinLevel(5) == LOW);
+}
+
+TEST(inputBounceBackIsNotAChange) {
+  ESPDomotic module;
+  Channel button("B", "button", 4, INPUT, HIGH);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&button);
+  module.addChannel(&light);
+  module.bindInputChannel(&button, &light);
+  fake::setPin(4, HIGH);
+  PubSubClient& client = startModule(module);
+  fake::setPin(4, LOW);
+  fake::advance(10);
+  fake::setPin(4, HIGH);
+  fake::advance(100);
+  module.loop();
+  CHECK(button.state == HIGH);
+  CHECK(fake::pinLevel(5) == HIGH);
+  CHECK(publishedCount(client, TOPIC_PREFIX "button/feedback/state") == 0);
+  CHECK(publishedCount(client, TOPIC_PREFIX "light/feedback/state") == 0);
+}
+
+TEST(inputTogglesBoundOutput) {
+  ESPDomotic module;
+  Channel button("B", "button", 4, INPUT, HIGH);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&button);
+  module.addChannel(&light);
+  module.bindInputChannel(&button, &light);
+  fake::setPin(4, HIGH);
+  PubSubClient& client = startModule(module);
+  fake::setPin(4, LOW);
+  fake::advance(50);
+  module.loop();
+  CHECK(fake::pinLevel(5) == LOW);
+  CHECK(light.locallyChanged);
+  const PubSubClient::Message* input = client.lastPublished(TOPIC_PREFIX "button/feedback/state");
+  CHECK(input && input->payload == "1");
+  const PubSubClient::Message* output = client.lastPublished(TOPIC_PREFIX "light/feedback/state");
+  CHECK(output && output->payload == "1");
+  // Each change of the input toggles the output, not just the presses
+  fake::setPin(4, HIGH);
+  fake::advance(50);
+  module.loop();
+  CHECK(fake::pinLevel(5) == HIGH);
+  output = client.lastPublished(TOPIC_PREFIX "light/feedback/state");
+  CHECK(output && output->payload == "0");
+  CHECK(publishedCount(client, TOPIC_PREFIX "light/feedback/state") == 2);
+}
+
+TEST(inputOnGpio16IsPolled) {
+  ESPDomotic module;
+  Channel button("B", "button", 16, INPUT, HIGH);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&button);
+  module.addChannel(&light);
+  module.bindInputChannel(&button, &light);
+  fake::setPin(16, HIGH);
+  startModule(module);
+  // No interrupt is attached, the edge is just seen when the loop reads the pin
+  fake::setPin(16, LOW);
+  fake::advance(100);
+  module.loop();
+  CHECK(button.state == HIGH);
+  fake::advance(50);
+  module.loop();
+  CHECK(button.state == LOW);
+  CHECK(fake::pinLevel(5) == LOW);
+}
+
+TEST(inputEventsOverflowRescansInputs) {
+  ESPDomotic module;
+  Channel noisy("N", "noisy", 4, INPUT, HIGH);
+  Channel button("B", "button", 12, INPUT, HIGH);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&noisy);
+  module.addChannel(&button);
+  module.addChannel(&light);
+  module.bindInputChannel(&button, &light);
+  fake::setPin(4, HIGH);
+  fake::setPin(12, HIGH);
+  startModule(module);
+  // The noisy input fills the queue, so the button edge is lost
+  for (uint8_t i = 0; i < INPUT_EVENTS_QUEUE_SIZE; ++i) {
+    fake::setPin(4, i % 2 ? HIGH : LOW);
+  }
+  fake::setPin(12, LOW);
+  fake::advance(50);
+  module.loop();
+  fake::advance(50);
+  module.loop();
+  CHECK(button.state == LOW);
+  CHECK(fake::pinLevel(5) == LOW);
+  CHECK(noisy.state == HIGH);
+}
@@ -0,0 +1,119 @@
+#include "fixture.h"
+
+#ifdef MQTT_LOG
+TEST(logRingWrapsAround) {
+  LogRing ring;
+  char line[32];
+  char read[32];
+  uint8_t level;
+  // Enough lines to wrap the buffer many times, and its free running counters too
+  for (unsigned i = 0; i < 10000; ++i) {
+    size_t length = snprintf(line, sizeof(line), "line %u", i);
+    CHECK(ring.push(i % 4 + 1, line, length));
+    if (i % 3 == 0) {
+      continue;
+    }
+    while (!ring.isEmpty()) {
+      CHECK(ring.peek(&level, read, sizeof(read)) > 0);
+      ring.pop();
+    }
+    CHECK(strcmp(read, line) == 0 && level == i % 4 + 1);
+  }
+  CHECK(ring.takeDropped() == 0);
+}
+
+TEST(logRingCountsDropped) {
+  LogRing ring;
+  char line[50];
+  memset(line, 'x', sizeof(line));
+  unsigned pushed = 0;
+  while (ring.push(DOMOTIC_LOG_LEVEL_INFO, line, sizeof(line))) {
+    ++pushed;
+  }
+  CHECK(pushed == MQTT_LOG_BUFFER_SIZE / (sizeof(line) + 2));
+  CHECK(!ring.push(DOMOTIC_LOG_LEVEL_INFO, line, sizeof(line)));
+  CHECK(!ring.push(DOMOTIC_LOG_LEVEL_INFO, line, sizeof(line)));
+  CHECK(ring.takeDropped() == 3);
+  CHECK(ring.takeDropped() == 0);
+  // A short line still fits the room left
+  CHECK(ring.push(DOMOTIC_LOG_LEVEL_INFO, "x", 1));
+  ring.pop();
+  CHECK(ring.push(DOMOTIC_LOG_LEVEL_INFO, line, sizeof(line)));
+}
+
+TEST(logRingTruncatesLongLines) {
+  LogRing ring;
+  char line[300];
+  memset(line, 'x', sizeof(line));
+  CHECK(ring.push(DOMOTIC_LOG_LEVEL_WARN, line, sizeof(line)));
+  CHECK(ring.push(DOMOTIC_LOG_LEVEL_INFO, "next", 4));
+  char read[400];
+  uint8_t level;
+  CHECK(ring.peek(&level, read, sizeof(read)) == 255);
+  CHECK(level == DOMOTIC_LOG_LEVEL_WARN && strlen(read) == 255);
+  // Read into a smaller buffer the line is cut, but pop still skips all of it
+  CHECK(ring.peek(&level, read, 10) == 9);
+  ring.pop();
+  CHECK(ring.peek(&level, read, sizeof(read)) == 4 && strcmp(read, "next") == 0);
+}
+
+// Bytes of the log lines published since the index
+static size_t logBytes(PubSubClient& client, size_t from) {
+  size_t bytes = 0;
+  for (size_t i = from; i < client.published.size(); ++i) {
+    if (client.published[i].topic == TOPIC_PREFIX "log") {
+      bytes += client.published[i].payload.size();
+    }
+  }
+  return bytes;
+}
+
+TEST(logDrainKeepsItsBudget) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  fake::advance(_mqtt_log_drain_period_millis);
+  module.loop();
+  // Invalid commands log a couple of lines each
+  for (unsigned i = 0; i < 6; ++i) {
+    client.deliver(TOPIC_PREFIX "light/command/state", "x");
+  }
+  size_t from = client.published.size();
+  fake::advance(_mqtt_log_drain_period_millis);
+  module.loop();
+  size_t drained = logBytes(client, from);
+  // The last line taken may go over, lines are up to 127 chars plus the level code
+  CHECK(drained >= _mqtt_log_budget && drained < _mqtt_log_budget + 129);
+  // Nothing else goes out until the period is over
+  from = client.published.size();
+  fake::advance(_mqtt_log_drain_period_millis - 1);
+  module.loop();
+  CHECK(logBytes(client, from) == 0);
+  fake::advance(1);
+  module.loop();
+  CHECK(logBytes(client, from) > 0);
+  const PubSubClient::Message* line = client.lastPublished(TOPIC_PREFIX "log");
+  CHECK(line && line->payload.compare(0, 2, "D ") == 0 && !line->retained);
+}
+
+TEST(logDrainReportsDroppedLines) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  // More lines than the ring holds between two drains
+  for (unsigned i = 0; i < 30; ++i) {
+    client.deliver(TOPIC_PREFIX "light/command/state", "x");
+  }
+  module.loop();
+  size_t from = client.published.size();
+  fake::advance(_mqtt_log_drain_period_millis);
+  module.loop();
+  CHECK(from < client.published.size());
+  const PubSubClient::Message& first = client.published[from];
+  CHECK(first.topic == TOPIC_PREFIX "log");
+  unsigned dropped = 0;
+  CHECK(sscanf(first.payload.c_str(), "W %u log lines dropped", &dropped) == 1 && dropped > 0);
+}
+#endif
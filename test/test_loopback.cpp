@@ -0,0 +1,105 @@
+#include "fixture.h"
+#include <vector>
+
+// Boots the module through the loopback, with the wifi down
+static void startLoopbackModule(ESPDomotic& module, LoopbackTransport& loopback) {
+  WiFi.fakeStatus = WL_DISCONNECTED;
+  ESPConfig::portalConnects = false;
+  ESPConfig::portalValues = {
+    {"moduleLocation", "home"},
+    {"moduleName", "lights"}
+  };
+  module.setTransport(&loopback);
+  module.init();
+  module.loop();
+}
+
+static bool injectText(LoopbackTransport& loopback, const char* topic, const char* payload) {
+  return loopback.inject(topic, (const uint8_t*) payload, strlen(payload));
+}
+
+TEST(loopbackRunsWhileStandalone) {
+  ESPDomotic module;
+  LoopbackTransport loopback;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  std::vector<std::string> published;
+  loopback.setPublishObserver([&published](const char* topic, const uint8_t* payload, unsigned int length, bool) {
+    published.push_back(std::string(topic) + "=" + std::string((const char*) payload, length));
+  });
+  startLoopbackModule(module, loopback);
+  CHECK(loopback.connected());
+  CHECK(injectText(loopback, TOPIC_PREFIX "light/command/state", "1"));
+  module.loop();
+  CHECK(fake::pinLevel(5) == LOW);
+  bool feedback = false;
+  for (const std::string& message : published) {
+    feedback = feedback || message == TOPIC_PREFIX "light/feedback/state=1";
+  }
+  CHECK(feedback);
+  // Commands published by the module itself come back, as through a broker
+  CHECK(loopback.publish(TOPIC_PREFIX "light/command/state", "0"));
+  module.loop();
+  CHECK(fake::pinLevel(5) == HIGH);
+}
+
+TEST(loopbackPublishesLastWillWhenGoingOffline) {
+  ESPDomotic module;
+  LoopbackTransport loopback;
+  std::string availability;
+  bool retained = false;
+  loopback.setPublishObserver([&](const char* topic, const uint8_t* payload, unsigned int length, bool retain) {
+    if (strcmp(topic, TOPIC_PREFIX "availability") == 0) {
+      availability.assign((const char*) payload, length);
+      retained = retain;
+    }
+  });
+  startLoopbackModule(module, loopback);
+  CHECK(availability == "online");
+  loopback.setOnline(false);
+  CHECK(!loopback.connected());
+  CHECK(availability == "offline");
+  CHECK(retained);
+}
+
+TEST(loopbackReportsMessagesItCanNotQueue) {
+  LoopbackTransport loopback;
+  CHECK(loopback.connect("id", NULL, 0, false, NULL, true));
+  for (int i = 0; i < LOOPBACK_QUEUE_SIZE; ++i) {
+    CHECK(injectText(loopback, "a/b", "1"));
+  }
+  CHECK(!injectText(loopback, "a/b", "1"));
+  CHECK(loopback.dropped == 1);
+  // Subscribed messages that do not fit the queue make publish fail
+  CHECK(loopback.subscribe("a/#", 0));
+  CHECK(!loopback.publish("a/c", "1"));
+  CHECK(loopback.dropped == 2);
+  loopback.loop();
+  std::string longPayload(_loopbackPayloadMaxLength + 1, 'x');
+  CHECK(!loopback.publish("a/c", longPayload.c_str()));
+  CHECK(loopback.dropped == 3);
+}
+
+TEST(loopbackCarriesTheSnapshot) {
+  ESPDomotic module;
+  LoopbackTransport loopback;
+  Channel channels[] = {
+    Channel("A", "light0", 5, OUTPUT, HIGH), Channel("B", "light1", 4, OUTPUT, HIGH),
+    Channel("C", "light2", 12, OUTPUT, HIGH), Channel("D", "light3", 13, OUTPUT, HIGH),
+    Channel("E", "light4", 14, OUTPUT, HIGH), Channel("F", "light5", 15, OUTPUT, HIGH),
+    Channel("G", "light6", 16, OUTPUT, HIGH), Channel("H", "light7", 0, OUTPUT, HIGH)
+  };
+  for (Channel& channel : channels) {
+    module.addChannel(&channel);
+  }
+  std::string snapshot;
+  loopback.setPublishObserver([&snapshot](const char* topic, const uint8_t* payload, unsigned int length, bool) {
+    if (strcmp(topic, TOPIC_PREFIX "snapshot") == 0) {
+      snapshot.assign((const char*) payload, length);
+    }
+  });
+  startLoopbackModule(module, loopback);
+  CHECK(snapshot.size() > 8 * 50);
+  CHECK(snapshot.find("\"name\":\"light7\"") != std::string::npos);
+  CHECK(loopback.dropped == 0);
+}
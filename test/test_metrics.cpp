@@ -0,0 +1,70 @@
+#include "fixture.h"
+
+#ifdef METRICS
+// Value of a counter in the last metrics published, -1 if none
+static long publishedMetric(PubSubClient& client, const char* name) {
+  const PubSubClient::Message* message = client.lastPublished(TOPIC_PREFIX "metrics");
+  if (!message) {
+    return -1;
+  }
+  std::string key = std::string("\"") + name + "\":";
+  size_t at = message->payload.find(key);
+  return at == std::string::npos ? -1 : atol(message->payload.c_str() + at + key.size());
+}
+
+TEST(metricsCountValidNoOpsAsHandled) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  PubSubClient& client = startModule(module);
+  // Same enablement, timer, name and state the channel already has
+  client.deliver(TOPIC_PREFIX "light/command/enable", "1");
+  client.deliver(TOPIC_PREFIX "light/command/timer", "1");
+  client.deliver(TOPIC_PREFIX "light/command/rename", "light");
+  client.deliver(TOPIC_PREFIX "light/command/state", "0");
+  // Rejected ones
+  client.deliver(TOPIC_PREFIX "light/command/enable", "maybe");
+  client.deliver(TOPIC_PREFIX "light/command/timer", "-5");
+  client.deliver(TOPIC_PREFIX "light/command/rename", "a/b");
+  client.deliver(TOPIC_PREFIX "light/command/state", "x");
+  for (int i = 0; i < 8; ++i) {
+    module.loop();
+  }
+  fake::advance(_metrics_period_millis);
+  module.loop();
+  CHECK(publishedMetric(client, "handled") == 4);
+  CHECK(publishedMetric(client, "dropped") == 4);
+  CHECK(publishedMetric(client, "feedbackDropped") == 0);
+}
+
+TEST(metricsCountJustTheSettingsWritten) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  module.setSettingsCommitDelay(1000);
+  PubSubClient& client = startModule(module);
+  // The flash is full, the save fails and is tried again after each window
+  LittleFS.writeBudget = 0;
+  client.deliver(TOPIC_PREFIX "light/command/rename", "lamp");
+  module.loop();
+  fake::advance(_metrics_period_millis);
+  module.loop();
+  CHECK(publishedMetric(client, "flashWrites") == 0);
+  LittleFS.writeBudget = -1;
+  fake::advance(1000);
+  module.loop();
+  fake::advance(_metrics_period_millis);
+  module.loop();
+  CHECK(publishedMetric(client, "flashWrites") == 1);
+}
+
+TEST(metricsFormatFeedbackDropped) {
+  RuntimeMetrics metrics = {};
+  metrics.resetLoop();
+  metrics.messagesDropped = 2;
+  metrics.feedbackDropped = 3;
+  char buff[256];
+  CHECK(metrics.format(buff, sizeof(buff), 1000, 500) > 0);
+  CHECK(strstr(buff, "\"dropped\":2,\"feedbackDropped\":3,") != NULL);
+}
+#endif
@@ -0,0 +1,244 @@
+#include "fixture.h"
+
+TEST(initDrivesOutputsAndConnects) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  CHECK(fake::pinMode(5) == OUTPUT);
+  CHECK(fake::pinLevel(5) == HIGH);
+  CHECK(LittleFS.exists("/config.json"));
+  CHECK(client.connected());
+  CHECK(client.host == "10.0.0.1" && client.port == 1883);
+  CHECK(client.clientId == "generic_home_lights");
+  CHECK(isSubscribed(client, TOPIC_PREFIX "command/#"));
+  CHECK(isSubscribed(client, TOPIC_PREFIX "light/command/+"));
+  const PubSubClient::Message* online = client.lastPublished(TOPIC_PREFIX "availability");
+  CHECK(online && online->payload == "online" && online->retained);
+}
+
+TEST(stateCommandDrivesOutput) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  client.deliver(TOPIC_PREFIX "light/command/state", "1");
+  module.loop();
+  CHECK(fake::pinLevel(5) == LOW);
+  const PubSubClient::Message* feedback = client.lastPublished(TOPIC_PREFIX "light/feedback/state");
+  CHECK(feedback && feedback->payload == "1");
+}
+
+TEST(statesCommandDrivesOutputsAtOnce) {
+  ESPDomotic module;
+  Channel channels[] = {
+    Channel("A", "light", 5, OUTPUT, HIGH),
+    Channel("B", "fan", 4, OUTPUT, HIGH),
+    Channel("C", "heater", 16, OUTPUT, HIGH),
+    Channel("D", "pump", 12, OUTPUT, HIGH),
+    Channel("E", "button", 13, INPUT, HIGH)
+  };
+  channels[3].enabled = false;
+  for (Channel& channel : channels) {
+    module.addChannel(&channel);
+  }
+  fake::setPin(13, HIGH);
+  PubSubClient& client = startModule(module);
+  GPOS.written = GPOC.written = 0;
+  unsigned heaterWrites = fake::pinWrites(16);
+  unsigned pumpWrites = fake::pinWrites(12);
+  // Disabled and input channels are skipped
+  client.deliver(TOPIC_PREFIX "command/states", "11111");
+  module.loop();
+  CHECK(GPOC.written == ((1UL << 5) | (1UL << 4)));
+  CHECK(GPOS.written == 0);
+  // GPIO16 is out of the gpio registers
+  CHECK(fake::pinWrites(16) == heaterWrites + 1);
+  CHECK(fake::pinLevel(16) == LOW);
+  CHECK(fake::pinWrites(12) == pumpWrites && fake::pinLevel(12) == HIGH && channels[3].state == HIGH);
+  CHECK(channels[4].state == HIGH);
+  CHECK(publishedCount(client, TOPIC_PREFIX "feedback/states") == 1);
+  CHECK(client.lastPublished(TOPIC_PREFIX "feedback/states")->payload == "11100");
+  CHECK(publishedCount(client, TOPIC_PREFIX "light/feedback/state") == 0);
+  GPOS.written = GPOC.written = 0;
+  client.deliver(TOPIC_PREFIX "command/states", "0-0");
+  module.loop();
+  CHECK(GPOS.written == (1UL << 5));
+  CHECK(GPOC.written == 0);
+  CHECK(fake::pinLevel(5) == HIGH && fake::pinLevel(4) == LOW && fake::pinLevel(16) == HIGH);
+  CHECK(publishedCount(client, TOPIC_PREFIX "feedback/states") == 2);
+  CHECK(client.lastPublished(TOPIC_PREFIX "feedback/states")->payload == "01000");
+}
+
+TEST(statesFeedbackIsQueuedWhileOffline) {
+  ESPDomotic module;
+  Channel channels[] = {
+    Channel("A", "light", 5, OUTPUT, HIGH),
+    Channel("B", "fan", 4, OUTPUT, HIGH),
+    Channel("C", "heater", 16, OUTPUT, HIGH)
+  };
+  for (Channel& channel : channels) {
+    module.addChannel(&channel);
+  }
+  PubSubClient& client = startModule(module);
+  // The connection breaks while the command is taken
+  client.acceptPublishes = false;
+  client.deliver(TOPIC_PREFIX "command/states", "1-1");
+  module.loop();
+  CHECK(fake::pinLevel(5) == LOW && fake::pinLevel(16) == LOW);
+  CHECK(publishedCount(client, TOPIC_PREFIX "feedback/states") == 0);
+  client.acceptPublishes = true;
+  client.drop();
+  waitConnectAttempt(module, client);
+  CHECK(client.connected());
+  // Each changed channel gets its feedback once connected again
+  const PubSubClient::Message* light = client.lastPublished(TOPIC_PREFIX "light/feedback/state");
+  CHECK(light && light->payload == "1");
+  const PubSubClient::Message* heater = client.lastPublished(TOPIC_PREFIX "heater/feedback/state");
+  CHECK(heater && heater->payload == "1");
+  CHECK(publishedCount(client, TOPIC_PREFIX "fan/feedback/state") == 0);
+}
+
+TEST(configSurvivesReboot) {
+  {
+    ESPDomotic module;
+    startModule(module);
+  }
+  // Booting again, the module takes the saved config instead of running the portal
+  ESPConfig::portalRuns = 0;
+  ESPConfig::portalValues.clear();
+  ESPDomotic module;
+  module.init();
+  CHECK(ESPConfig::portalRuns == 0);
+  CHECK(strcmp(module.getModuleName(), "lights") == 0);
+  CHECK(strcmp(module.getMqttServerHost(), "10.0.0.1") == 0);
+  CHECK(module.getMqttServerPort() == 1883);
+}
+
+TEST(topicsFollowTheLoadedConfig) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  // Asked before the config is there, the prefix has empty levels
+  CHECK(module.getStationTopic("log") == String("generic///log"));
+  // With no wifi the network services, wich build the prefix too, are not started
+  WiFi.fakeStatus = WL_DISCONNECTED;
+  ESPConfig::portalConnects = false;
+  startModule(module);
+  CHECK(module.getStationTopic("log") == String(TOPIC_PREFIX "log"));
+  CHECK(strcmp(module.getChannelTopic(&channel, "command/state").c_str(), TOPIC_PREFIX "light/command/state") == 0);
+  char topic[16];
+  // Truncated to the buffer
+  CHECK(module.getChannelTopic(&channel, "feedback/state", topic, sizeof(topic)) == sizeof(topic) - 1);
+  CHECK(strncmp(topic, TOPIC_PREFIX, sizeof(topic) - 1) == 0);
+}
+
+TEST(sketchFilesAreNotCached) {
+  ESPDomotic module;
+  startModule(module);
+  CHECK(module.getFileSize("/user.txt") == 0);
+  // Written by the sketch, not through the module
+  LittleFS.put("/user.txt", "abc", 3);
+  CHECK(module.getFileSize("/user.txt") == 3);
+  char buff[8] = {};
+  CHECK(module.readFile("/user.txt", buff, sizeof(buff)) == 3);
+  LittleFS.put("/user.txt", "abcdef", 6);
+  CHECK(module.getFileSize("/user.txt") == 6);
+}
+
+TEST(snapshotEscapesControlChars) {
+  ESPDomotic module;
+  Channel channel("A\x01\x1f", "li\"ght", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  PubSubClient& client = startModule(module);
+  const PubSubClient::Message* snapshot = client.lastPublished(TOPIC_PREFIX "snapshot");
+  CHECK(snapshot != NULL);
+  CHECK(snapshot->payload.find("\"id\":\"A\\u0001\\u001f\",\"name\":\"li\\\"ght\"") != std::string::npos);
+}
+
+TEST(feedbackBlinksWhileConnectingWifi) {
+  {
+    ESPDomotic configured;
+    startModule(configured);
+  }
+  WiFi.fakeStatus = WL_DISCONNECTED;
+  ESPDomotic module;
+  module.setFeedbackPin(2);
+  module.init();
+  int toggles = 0;
+  uint8_t level = fake::pinLevel(2);
+  for (int i = 0; i < 50; ++i) {
+    fake::advance(100);
+    module.loop();
+    if (fake::pinLevel(2) != level) {
+      level = fake::pinLevel(2);
+      ++toggles;
+    }
+  }
+  CHECK(module.getConnectivityState() == CONNECTIVITY_CONNECTING);
+  CHECK(toggles >= 10);
+  WiFi.fakeStatus = WL_CONNECTED;
+  for (int i = 0; i < 50; ++i) {
+    fake::advance(100);
+    module.loop();
+  }
+  CHECK(module.getConnectivityState() == CONNECTIVITY_CONNECTED);
+  CHECK(fake::pinLevel(2) == LOW);
+}
+
+// Runs the loop in 50 millis steps for the millis given. Returns the times the feedback pin toggled.
+static int runCountingFeedback(ESPDomotic& module, uint32_t millis) {
+  int toggles = 0;
+  uint8_t level = fake::pinLevel(2);
+  for (uint32_t elapsed = 0; elapsed < millis; elapsed += 50) {
+    fake::advance(50);
+    module.loop();
+    if (fake::pinLevel(2) != level) {
+      level = fake::pinLevel(2);
+      ++toggles;
+    }
+  }
+  return toggles;
+}
+
+TEST(wifiRetriesFromStandAlone) {
+  {
+    // The portal is offered once, by this first boot
+    ESPDomotic configured;
+    startModule(configured);
+  }
+  WiFi.fakeStatus = WL_DISCONNECTED;
+  ESPConfig::portalRuns = 0;
+  std::vector<ConnectivityState> states;
+  ESPDomotic module;
+  module.setFeedbackPin(2);
+  module.setWifiConnectTimeout(5);
+  module.setWifiRetryInterval(10);
+  module.setConnectivityCallback([&states](ConnectivityState state) { states.push_back(state); });
+  module.init();
+  unsigned begins = WiFi.begins;
+  // Blinks while connecting, until the connection times out
+  CHECK(runCountingFeedback(module, 4900) >= 16);
+  CHECK(module.getConnectivityState() == CONNECTIVITY_CONNECTING);
+  runCountingFeedback(module, 200);
+  CHECK(module.getConnectivityState() == CONNECTIVITY_STANDALONE);
+  // Stand alone the pin blinks once (2 seconds on) and stays off until the retry
+  CHECK(fake::pinLevel(2) == HIGH);
+  CHECK(runCountingFeedback(module, 9700) == 1);
+  CHECK(fake::pinLevel(2) == LOW);
+  CHECK(WiFi.begins == begins);
+  runCountingFeedback(module, 200);
+  CHECK(module.getConnectivityState() == CONNECTIVITY_CONNECTING);
+  CHECK(WiFi.begins == begins + 1);
+  CHECK(runCountingFeedback(module, 1000) >= 3);
+  WiFi.fakeStatus = WL_CONNECTED;
+  runCountingFeedback(module, 2000);
+  CHECK(module.getConnectivityState() == CONNECTIVITY_CONNECTED);
+  CHECK(fake::pinLevel(2) == LOW);
+  CHECK(module.getMqttClient()->connected());
+  CHECK(ESPConfig::portalRuns == 0);
+  std::vector<ConnectivityState> walk = {
+    CONNECTIVITY_CONNECTING, CONNECTIVITY_STANDALONE, CONNECTIVITY_CONNECTING, CONNECTIVITY_CONNECTED
+  };
+  CHECK(states == walk);
+}
@@ -0,0 +1,179 @@
+#include "fixture.h"
+
+TEST(reconnectionBacksOffExponentially) {
+  ESPDomotic module;
+  PubSubClient& client = *module.getMqttClient();
+  client.acceptConnections = false;
+  startModule(module);
+  CHECK(client.connectAttempts == 1);
+  unsigned long wait = _mqtt_reconnection_retry_wait_millis;
+  for (unsigned failures = 1; failures <= 10; ++failures) {
+    uint32_t waited = waitConnectAttempt(module, client);
+    CHECK(client.connectAttempts == failures + 1);
+    // Jitter takes the wait anywhere between its half and the whole of it
+    CHECK(waited >= wait / 2 && waited <= wait + 100);
+    wait = wait * 2 < _mqtt_reconnection_max_wait_millis ? wait * 2 : _mqtt_reconnection_max_wait_millis;
+  }
+}
+
+TEST(reconnectionWaitsDoNotBlockTheLoop) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = *module.getMqttClient();
+  client.acceptConnections = false;
+  startModule(module);
+  // No attempt is made before the wait is over, while the channels keep running
+  fake::advance(_mqtt_reconnection_retry_wait_millis / 2 - 1);
+  module.loop();
+  CHECK(client.connectAttempts == 1);
+  CHECK(module.updateChannelState(&light, LOW));
+  CHECK(fake::pinLevel(5) == LOW);
+}
+
+TEST(reconnectionStartsOverOnceConnected) {
+  ESPDomotic module;
+  PubSubClient& client = *module.getMqttClient();
+  client.acceptConnections = false;
+  startModule(module);
+  for (unsigned i = 0; i < 5; ++i) {
+    waitConnectAttempt(module, client);
+  }
+  client.acceptConnections = true;
+  waitConnectAttempt(module, client);
+  CHECK(client.connected());
+  unsigned attempts = client.connectAttempts;
+  // A broker dropping the session right away is retried after the base wait, not the backed off one
+  client.drop();
+  uint32_t waited = waitConnectAttempt(module, client);
+  CHECK(client.connectAttempts == attempts + 1);
+  CHECK(waited <= _mqtt_reconnection_retry_wait_millis + 100);
+  CHECK(client.connected());
+}
+
+TEST(reconnectionResubscribesAndRepublishes) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  client.drop();
+  // The broker published the last will
+  const PubSubClient::Message* will = client.lastPublished(TOPIC_PREFIX "availability");
+  CHECK(will && will->payload == "offline" && will->retained);
+  waitConnectAttempt(module, client);
+  CHECK(client.connected());
+  CHECK(isSubscribed(client, TOPIC_PREFIX "light/command/+"));
+  CHECK(client.lastPublished(TOPIC_PREFIX "availability")->payload == "online");
+  CHECK(client.lastPublished(TOPIC_PREFIX "snapshot") != NULL);
+}
+
+// Millis each packet takes in the subscription tests, so the connection time tells the packets sent
+static const uint32_t _packetMillis = 10;
+
+// Boots the module with every channel it holds, each packet to the broker taking its millis
+static PubSubClient& startFullModule(ESPDomotic& module, Channel* channels) {
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    module.addChannel(&channels[i]);
+  }
+  module.getMqttClient()->packetMillis = _packetMillis;
+  return startModule(module);
+}
+
+// Channels named ch0, ch1...
+static std::vector<Channel> fullChannels() {
+  std::vector<Channel> channels(MAX_CHANNELS, Channel("A", "unset", 5, OUTPUT, HIGH));
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    char name[8];
+    snprintf(name, sizeof(name), "ch%u", i);
+    channels[i].updateName(name);
+  }
+  return channels;
+}
+
+TEST(subscriptionsPerChannel) {
+  ESPDomotic module;
+  std::vector<Channel> channels = fullChannels();
+  PubSubClient& client = startFullModule(module, channels.data());
+  CHECK(client.subscribes == 1 + MAX_CHANNELS);
+  CHECK(isSubscribed(client, TOPIC_PREFIX "ch7/command/+"));
+  // Connect, subscriptions, availability and snapshot
+  CHECK(module.getMqttConnectMillis() == _packetMillis * (1 + 1 + MAX_CHANNELS + 2));
+}
+
+TEST(subscriptionsCollapsed) {
+  ESPDomotic module;
+  module.setMqttCollapsedSubscriptions(true);
+  std::vector<Channel> channels = fullChannels();
+  PubSubClient& client = startFullModule(module, channels.data());
+  CHECK(client.subscribes == 2);
+  CHECK(isSubscribed(client, TOPIC_PREFIX "command/#"));
+  CHECK(isSubscribed(client, TOPIC_PREFIX "+/command/+"));
+  CHECK(!isSubscribed(client, TOPIC_PREFIX "ch7/command/+"));
+  // Whatever the channels count, the connection takes the same packets
+  CHECK(module.getMqttConnectMillis() == _packetMillis * (1 + 2 + 2));
+}
+
+TEST(renameWithCollapsedSubscriptions) {
+  ESPDomotic module;
+  module.setMqttCollapsedSubscriptions(true);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  unsigned subscribes = client.subscribes;
+  client.deliver(TOPIC_PREFIX "light/command/rename", "lamp");
+  module.loop();
+  CHECK(strcmp(light.name, "lamp") == 0);
+  CHECK(client.subscribes == subscribes && client.unsubscribes == 0);
+  // The dispatcher takes the new name straight away
+  client.deliver(TOPIC_PREFIX "lamp/command/state", "1");
+  client.deliver(TOPIC_PREFIX "light/command/state", "0");
+  module.loop();
+  CHECK(fake::pinLevel(5) == LOW);
+}
+
+TEST(sessionIsCleanByDefault) {
+  ESPDomotic module;
+  PubSubClient& client = startModule(module);
+  CHECK(client.connected());
+  CHECK(client.cleanSession);
+}
+
+TEST(persistentSessionKeepsSubscriptions) {
+  ESPDomotic module;
+  module.setMqttPersistentSession(true);
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  CHECK(client.connected());
+  CHECK(!client.cleanSession);
+  client.drop();
+  waitConnectAttempt(module, client);
+  CHECK(client.connected() && !client.cleanSession);
+  CHECK(isSubscribed(client, TOPIC_PREFIX "light/command/+"));
+}
+
+TEST(offlineFeedbackIsCoalesced) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  Channel fan("B", "fan", 4, OUTPUT, HIGH);
+  module.addChannel(&light);
+  module.addChannel(&fan);
+  PubSubClient& client = startModule(module);
+  client.acceptConnections = false;
+  client.drop();
+  // Toggled while offline, each channel keeps a single pending feedback
+  for (unsigned i = 0; i < 5; ++i) {
+    module.updateChannelState(&light, light.state == LOW ? HIGH : LOW);
+    module.updateChannelState(&fan, fan.state == LOW ? HIGH : LOW);
+    module.loop();
+  }
+  module.updateChannelState(&fan, HIGH);
+  client.published.clear();
+  client.acceptConnections = true;
+  waitConnectAttempt(module, client);
+  CHECK(client.connected());
+  CHECK(publishedCount(client, TOPIC_PREFIX "light/feedback/state") == 1);
+  CHECK(client.lastPublished(TOPIC_PREFIX "light/feedback/state")->payload == "1");
+  CHECK(publishedCount(client, TOPIC_PREFIX "fan/feedback/state") == 1);
+  CHECK(client.lastPublished(TOPIC_PREFIX "fan/feedback/state")->payload == "0");
+}
@@ -0,0 +1,145 @@
+#include <ESPDomoticCore.h>
+#include <string>
+#include "test.h"
+
+static uint32_t _fuzzState = 12345;
+
+// Deterministic, so a failing payload can be reproduced
+static uint8_t fuzzByte() {
+  _fuzzState = _fuzzState * 1103515245 + 12345;
+  return _fuzzState >> 16;
+}
+
+// Random payload biased to digits and states chars, so valid ones come up often
+static std::string fuzzPayload(size_t maxLength, const char* alphabet) {
+  std::string payload(fuzzByte() % (maxLength + 1), '\0');
+  for (char& c : payload) {
+    uint8_t pick = fuzzByte();
+    c = pick < 200 ? alphabet[pick % strlen(alphabet)] : (char) fuzzByte();
+  }
+  return payload;
+}
+
+static bool parseUnsigned(const std::string& payload, unsigned long max, unsigned long* value) {
+  return PayloadView((const uint8_t*) payload.data(), payload.size()).toUnsigned(max, value);
+}
+
+// Reference parser, through arbitrary precision decimal comparison
+static bool referenceUnsigned(const std::string& payload, unsigned long max, unsigned long* value) {
+  if (payload.empty() || payload.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  std::string digits = payload.substr(payload.find_first_not_of('0') == std::string::npos ? payload.size() - 1 : payload.find_first_not_of('0'));
+  std::string limit = std::to_string(max);
+  if (digits.size() > limit.size() || (digits.size() == limit.size() && digits > limit)) {
+    return false;
+  }
+  *value = strtoul(digits.c_str(), NULL, 10);
+  return true;
+}
+
+TEST(unsignedPayloadLimits) {
+  unsigned long value = 7;
+  CHECK(parseUnsigned("0", 0, &value) && value == 0);
+  CHECK(!parseUnsigned("1", 0, &value));
+  CHECK(parseUnsigned("4294967295", 4294967295UL, &value) && value == 4294967295UL);
+  CHECK(!parseUnsigned("4294967296", 4294967295UL, &value));
+  CHECK(!parseUnsigned("99999999999999999999999999", 4294967295UL, &value));
+  CHECK(parseUnsigned("2147483", 2147483, &value) && value == 2147483);
+  CHECK(!parseUnsigned("2147484", 2147483, &value));
+  CHECK(parseUnsigned("0000000000000000000000042", 100, &value) && value == 42);
+  // The largest value the type holds
+  CHECK(parseUnsigned(std::to_string((unsigned long) -1), (unsigned long) -1, &value) && value == (unsigned long) -1);
+  CHECK(!parseUnsigned(std::to_string((unsigned long) -1) + "0", (unsigned long) -1, &value));
+}
+
+TEST(unsignedPayloadRejectsGarbage) {
+  const char* garbage[] = {"", " 1", "1 ", "+1", "-1", "1.0", "0x10", "1e3", "１", "12a", "a12"};
+  for (const char* payload : garbage) {
+    unsigned long value = 7;
+    CHECK(!parseUnsigned(payload, 1000000, &value));
+    CHECK(value == 7);
+  }
+  unsigned long value = 7;
+  // Nul within the payload, wich is not null terminated
+  CHECK(!parseUnsigned(std::string("1\0" "2", 3), 1000, &value));
+  CHECK(!PayloadView(NULL, 5).toUnsigned(1000, &value));
+  CHECK(value == 7);
+}
+
+TEST(unsignedPayloadFuzz) {
+  const unsigned long maxes[] = {0, 9, 10, 255, 65535, 2147483, 4294967295UL, (unsigned long) -1};
+  for (int i = 0; i < 200000; ++i) {
+    std::string payload = fuzzPayload(24, "0123456789");
+    unsigned long max = maxes[fuzzByte() % (sizeof(maxes) / sizeof(maxes[0]))];
+    unsigned long value = 0, expected = 0;
+    bool parsed = parseUnsigned(payload, max, &value);
+    CHECK(parsed == referenceUnsigned(payload, max, &expected));
+    CHECK(!parsed || (value == expected && value <= max));
+  }
+}
+
+static bool parseStates(const std::string& payload, uint8_t count, uint32_t* on, uint32_t* off) {
+  return PayloadView((const uint8_t*) payload.data(), payload.size()).toChannelsStates(count, on, off);
+}
+
+TEST(statesPayloadLimits) {
+  uint32_t on = 7, off = 7;
+  CHECK(!parseStates("", 4, &on, &off));
+  CHECK(parseStates("1", 4, &on, &off) && on == 1 && off == 0);
+  CHECK(parseStates("10-1", 4, &on, &off) && on == 0x9 && off == 0x2);
+  CHECK(parseStates("----", 4, &on, &off) && on == 0 && off == 0);
+  CHECK(!parseStates("10-10", 4, &on, &off));
+  std::string all(32, '1');
+  CHECK(parseStates(all, 32, &on, &off) && on == 0xFFFFFFFF && off == 0);
+  CHECK(!parseStates(all + "0", 32, &on, &off));
+  CHECK(!parseStates(all + "0", 255, &on, &off));
+  CHECK(!PayloadView(NULL, 3).toChannelsStates(4, &on, &off));
+}
+
+TEST(statesPayloadRejectsGarbage) {
+  const char* garbage[] = {"1x", " 1", "1 ", "2", "10+", "on", "1\n"};
+  for (const char* payload : garbage) {
+    uint32_t on = 7, off = 7;
+    CHECK(!parseStates(payload, 8, &on, &off));
+  }
+  uint32_t on, off;
+  CHECK(!parseStates(std::string("1\0" "0", 3), 8, &on, &off));
+}
+
+TEST(statesPayloadFuzz) {
+  for (int i = 0; i < 200000; ++i) {
+    std::string payload = fuzzPayload(40, "01-");
+    uint8_t count = fuzzByte() % 34;
+    uint32_t on = 0, off = 0;
+    bool parsed = parseStates(payload, count, &on, &off);
+    bool valid = !payload.empty() && payload.size() <= count && payload.size() <= 32
+        && payload.find_first_not_of("01-") == std::string::npos;
+    CHECK(parsed == valid);
+    if (parsed) {
+      CHECK((on & off) == 0);
+      for (size_t c = 0; c < 32; ++c) {
+        char state = c < payload.size() ? payload[c] : '-';
+        CHECK(((on >> c) & 1) == (state == '1'));
+        CHECK(((off >> c) & 1) == (state == '0'));
+      }
+    }
+  }
+}
+
+TEST(textPayloadFuzz) {
+  char buff[21];
+  for (int i = 0; i < 100000; ++i) {
+    std::string payload = fuzzPayload(24, "abc/+# ");
+    PayloadView view((const uint8_t*) payload.data(), payload.size());
+    bool copied = view.copyTo(buff, sizeof(buff));
+    bool printable = true;
+    for (char c : payload) {
+      printable = printable && (uint8_t) c >= ' ' && c != 0x7F;
+    }
+    CHECK(copied == (payload.size() < sizeof(buff) && printable));
+    CHECK(!copied || (strlen(buff) == payload.size() && memcmp(buff, payload.data(), payload.size()) == 0));
+    bool level = view.toTopicLevel(buff, sizeof(buff));
+    CHECK(level == (copied && !payload.empty() && payload.find_first_of("/+#") == std::string::npos));
+  }
+}
@@ -0,0 +1,280 @@
+#include <chrono>
+#include "fixture.h"
+
+// Channels as the sketch declares them, before the saved settings are loaded
+static void resetChannels(Channel* channels, uint8_t count) {
+  for (uint8_t i = 0; i < count; ++i) {
+    channels[i].updateName("unset");
+    channels[i].timer = 1000;
+    channels[i].enabled = true;
+    channels[i].state = HIGH;
+  }
+}
+
+// Settings and config are kept as binary records
+#ifdef USE_BINARY_SETTINGS
+static FileData& settingsFile() {
+  return *LittleFS.files["/settings.json"];
+}
+
+TEST(binarySettingsRoundTrip) {
+  ESPDomotic module;
+  Channel channels[] = {
+    Channel("A", "light", 5, OUTPUT, HIGH),
+    Channel("B", "fan", 4, OUTPUT, HIGH)
+  };
+  module.addChannel(&channels[0]);
+  module.addChannel(&channels[1]);
+  module.setPersistChannelsState(true);
+  PubSubClient& client = startModule(module);
+  client.deliver(TOPIC_PREFIX "light/command/timer", "600");
+  client.deliver(TOPIC_PREFIX "light/command/rename", "lamp");
+  client.deliver(TOPIC_PREFIX "fan/command/enable", "0");
+  client.deliver(TOPIC_PREFIX "lamp/command/state", "1");
+  module.loop();
+  module.loop();
+  module.flushChannelsSettings();
+  CHECK(LittleFS.content("/settings.json").compare(0, 4, "DCHN") == 0);
+  resetChannels(channels, 2);
+  // Booting again
+  module.init();
+  CHECK(strcmp(channels[0].name, "lamp") == 0);
+  CHECK(channels[0].timer == 600000);
+  CHECK(channels[0].enabled);
+  CHECK(channels[0].state == LOW);
+  CHECK(strcmp(channels[1].name, "fan") == 0);
+  CHECK(!channels[1].enabled);
+  CHECK(channels[1].state == HIGH);
+  CHECK(fake::pinLevel(5) == LOW);
+}
+
+TEST(truncatedSettingsRecordIsNotLoaded) {
+  ESPDomotic module;
+  Channel channels[] = { Channel("A", "light", 5, OUTPUT, HIGH) };
+  module.addChannel(&channels[0]);
+  startModule(module);
+  module.saveChannelsSettings();
+  size_t size = settingsFile().size();
+  // Cut within the body, within the header and right after the magic
+  const size_t lengths[] = { size - 1, size / 2, 8, 4 };
+  for (size_t length : lengths) {
+    module.saveChannelsSettings();
+    settingsFile().resize(length);
+    resetChannels(channels, 1);
+    module.init();
+    CHECK(strcmp(channels[0].name, "unset") == 0);
+    CHECK(channels[0].timer == 1000);
+  }
+}
+
+TEST(corruptSettingsRecordIsNotLoaded) {
+  ESPDomotic module;
+  Channel channels[] = { Channel("A", "light", 5, OUTPUT, HIGH) };
+  module.addChannel(&channels[0]);
+  startModule(module);
+  module.saveChannelsSettings();
+  size_t size = settingsFile().size();
+  // Every byte past the magic is covered, either by the header checks or by the CRC
+  for (size_t i = 4; i < size; ++i) {
+    module.saveChannelsSettings();
+    settingsFile()[i] ^= 0x20;
+    resetChannels(channels, 1);
+    fake::serial.clear();
+    module.init();
+    CHECK(strcmp(channels[0].name, "unset") == 0);
+    CHECK(fake::serial.find("Corrupt channels settings record") != std::string::npos);
+  }
+}
+
+// Channels record as version 1 firmwares wrote it, with no state
+struct ChannelRecordV1 {
+  char          id[8];
+  char          name[21];
+  uint8_t       enabled;
+  uint32_t      timer;
+};
+
+TEST(version1SettingsRecordIsMigrated) {
+  ESPDomotic module;
+  Channel channels[] = { Channel("A", "light", 5, OUTPUT, HIGH) };
+  module.addChannel(&channels[0]);
+  module.setPersistChannelsState(true);
+  struct {
+    uint32_t        magic;
+    uint16_t        version;
+    uint16_t        length;
+    uint32_t        crc;
+    ChannelRecordV1 channel;
+  } record;
+  memset(&record, 0, sizeof(record));
+  record.magic = 0x4E484344;
+  record.version = 1;
+  record.length = sizeof(ChannelRecordV1);
+  strcpy(record.channel.id, "A");
+  strcpy(record.channel.name, "lamp");
+  record.channel.enabled = 0;
+  record.channel.timer = 600000;
+  record.crc = crc32((const uint8_t*) &record.channel, sizeof(record.channel));
+  LittleFS.put("/settings.json", &record, sizeof(record));
+  resetChannels(channels, 1);
+  startModule(module);
+  CHECK(strcmp(channels[0].name, "lamp") == 0);
+  CHECK(channels[0].timer == 600000);
+  CHECK(!channels[0].enabled);
+  // Not kept by version 1, so not taken from the padding
+  CHECK(channels[0].state == HIGH);
+  // Rewritten in the current version
+  module.flushChannelsSettings();
+  CHECK(settingsFile()[4] == 2);
+  resetChannels(channels, 1);
+  module.init();
+  CHECK(strcmp(channels[0].name, "lamp") == 0);
+}
+
+TEST(corruptConfigRecordRunsThePortal) {
+  {
+    ESPDomotic module;
+    startModule(module);
+  }
+  LittleFS.files["/config.json"]->back() ^= 0x01;
+  ESPConfig::portalRuns = 0;
+  ESPDomotic module;
+  module.init();
+  CHECK(ESPConfig::portalRuns == 1);
+}
+#endif
+
+// Measures the channels settings load, binary against text, booting the module over and over
+static double measureLoad(ESPDomotic& module, Channel* channels, uint8_t count) {
+  const int loads = 2000;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < loads; ++i) {
+    resetChannels(channels, count);
+    module.init();
+    fake::serial.clear();
+  }
+  std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+  CHECK(strcmp(channels[count - 1].name, "ch7") == 0);
+  return elapsed.count() / loads;
+}
+
+TEST(benchmarkSettingsParse) {
+  ESPDomotic module;
+  Channel* channels = (Channel*) operator new(sizeof(Channel) * MAX_CHANNELS);
+  char ids[MAX_CHANNELS][4];
+  std::string text;
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    snprintf(ids[i], sizeof(ids[i]), "%c", 'A' + i);
+    new (&channels[i]) Channel(ids[i], "unset", i, OUTPUT, HIGH);
+    module.addChannel(&channels[i]);
+    char lines[96];
+    snprintf(lines, sizeof(lines), "%s_n=ch%u\n%s_t=600000\n%s_e=1\n%s_s=1\n", ids[i], i, ids[i], ids[i], ids[i]);
+    text += lines;
+  }
+  startModule(module);
+  for (uint8_t i = 0; i < MAX_CHANNELS; ++i) {
+    char name[8];
+    snprintf(name, sizeof(name), "ch%u", i);
+    channels[i].updateName(name);
+  }
+  module.saveChannelsSettings();
+  std::string binary = LittleFS.content("/settings.json");
+  double binaryMicros = measureLoad(module, channels, MAX_CHANNELS);
+  LittleFS.put("/settings.json", text.data(), text.size());
+  double textMicros = measureLoad(module, channels, MAX_CHANNELS);
+  printf("settings parse (%d channels, boot included): binary %zu bytes %.2f us, text %zu bytes %.2f us\n",
+    MAX_CHANNELS, binary.size(), binaryMicros, text.size(), textMicros);
+}
+
+TEST(settingsChangesWithinTheWindowAreWrittenOnce) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  module.setSettingsCommitDelay(1000);
+  PubSubClient& client = startModule(module);
+  unsigned renames = LittleFS.renames;
+  const char* commands[][2] = {
+    {"light/command/rename", "lamp"},
+    {"lamp/command/timer", "60"},
+    {"lamp/command/enable", "0"},
+    {"lamp/command/enable", "1"},
+    {"lamp/command/rename", "bulb"}
+  };
+  for (auto& command : commands) {
+    client.deliver((std::string(TOPIC_PREFIX) + command[0]).c_str(), command[1]);
+    module.loop();
+    fake::advance(150);
+  }
+  CHECK(LittleFS.renames == renames);
+  // The window started with the first change
+  fake::advance(1000 - 5 * 150);
+  module.loop();
+  CHECK(LittleFS.renames == renames + 1);
+  fake::advance(5000);
+  module.loop();
+  CHECK(LittleFS.renames == renames + 1);
+  resetChannels(&channel, 1);
+  module.init();
+  CHECK(strcmp(channel.name, "bulb") == 0 && channel.timer == 60000);
+}
+
+TEST(failedSettingsSaveIsTriedAgain) {
+  ESPDomotic module;
+  Channel channel("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  module.setSettingsCommitDelay(1000);
+  PubSubClient& client = startModule(module);
+  unsigned renames = LittleFS.renames;
+  LittleFS.writeBudget = 0;
+  client.deliver(TOPIC_PREFIX "light/command/rename", "lamp");
+  module.loop();
+  fake::advance(1000);
+  module.loop();
+  CHECK(LittleFS.renames == renames);
+  // Still pending, it is written once the next window is over
+  LittleFS.writeBudget = -1;
+  fake::advance(999);
+  module.loop();
+  CHECK(LittleFS.renames == renames);
+  fake::advance(1);
+  module.loop();
+  CHECK(LittleFS.renames == renames + 1);
+  resetChannels(&channel, 1);
+  module.init();
+  CHECK(strcmp(channel.name, "lamp") == 0);
+}
+
+// Saves the settings with the channel renamed, the write failing as the file system is set
+static void checkFailedSaveKeepsSettings(ESPDomotic& module, Channel& channel) {
+  std::string previous = LittleFS.content("/settings.json");
+  channel.updateName("bulb");
+  CHECK(!module.saveChannelsSettings());
+  LittleFS.writeBudget = -1;
+  LittleFS.failRenames = false;
+  CHECK(LittleFS.content("/settings.json") == previous);
+  CHECK(!LittleFS.exists("/settings.json.tmp"));
+  resetChannels(&channel, 1);
+  module.init();
+  CHECK(strcmp(channel.name, "lamp") == 0);
+}
+
+TEST(cutSettingsWriteKeepsThePreviousFile) {
+  ESPDomotic module;
+  Channel channel("A", "lamp", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  startModule(module);
+  CHECK(module.saveChannelsSettings());
+  // Power lost in the middle of the write
+  LittleFS.writeBudget = 10;
+  checkFailedSaveKeepsSettings(module, channel);
+}
+
+TEST(failedSettingsRenameKeepsThePreviousFile) {
+  ESPDomotic module;
+  Channel channel("A", "lamp", 5, OUTPUT, HIGH);
+  module.addChannel(&channel);
+  startModule(module);
+  CHECK(module.saveChannelsSettings());
+  LittleFS.failRenames = true;
+  checkFailedSaveKeepsSettings(module, channel);
+}
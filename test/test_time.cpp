@@ -0,0 +1,85 @@
+#include "fixture.h"
+
+TEST(deadlinesAcrossMillisRollover) {
+  CHECK(deadlineReached(0xFFFFFFF0, 0xFFFFFFF0));
+  CHECK(!deadlineReached(0xFFFFFFEF, 0xFFFFFFF0));
+  // Deadline past the rollover, now still before it
+  CHECK(!deadlineReached(0xFFFFFFFF, 0x00000010));
+  CHECK(!deadlineReached(0xFFFFFF00, 0x00000010));
+  CHECK(deadlineReached(0x00000010, 0x00000010));
+  CHECK(deadlineReached(0x00000011, 0x00000010));
+  // Deadline before the rollover, now past it
+  CHECK(deadlineReached(0x00000000, 0xFFFFFFFF));
+  CHECK(deadlineReached(0x00001000, 0xFFFFF000));
+  // Deadlines are told apart up to half the millis range, further behind they are taken as ahead
+  CHECK(deadlineReached(0x7FFFFFFE, 0xFFFFFFFF));
+  CHECK(!deadlineReached(0x7FFFFFFF, 0xFFFFFFFF));
+}
+
+TEST(deadlinesOrderAcrossMillisRollover) {
+  CHECK(deadlineBefore(0xFFFFFFF0, 0x00000010));
+  CHECK(!deadlineBefore(0x00000010, 0xFFFFFFF0));
+  CHECK(!deadlineBefore(0xFFFFFFFF, 0xFFFFFFFF));
+  CHECK(deadlineBefore(0xFFFFFFFF, 0x00000000));
+}
+
+TEST(channelTimerFiresAcrossMillisRollover) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH, 10000);
+  module.addChannel(&light);
+  PubSubClient& client = startModule(module);
+  fake::now = 0xFFFFFFFF - 5000;
+  client.deliver(TOPIC_PREFIX "light/command/state", "1");
+  module.loop();
+  CHECK(light.state == LOW);
+  // Millis overflow half way through the timer
+  fake::advance(9999);
+  CHECK(fake::now < 0xFFFFFFFF - 5000);
+  module.loop();
+  CHECK(light.state == LOW);
+  fake::advance(1);
+  module.loop();
+  CHECK(light.state == HIGH);
+  CHECK(fake::pinLevel(5) == HIGH);
+  CHECK(module.getNextTimerDeadline() == 0);
+}
+
+TEST(earliestTimerIsTakenAcrossMillisRollover) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH, 20000);
+  Channel fan("B", "fan", 4, OUTPUT, HIGH, 3000);
+  module.addChannel(&light);
+  module.addChannel(&fan);
+  PubSubClient& client = startModule(module);
+  fake::now = 0xFFFFFFFF - 1000;
+  client.deliver(TOPIC_PREFIX "light/command/state", "1");
+  client.deliver(TOPIC_PREFIX "fan/command/state", "1");
+  module.loop();
+  // The fan deadline is past the rollover, so it is numerically lower but still the earliest
+  CHECK((uint32_t) module.getNextTimerDeadline() == (uint32_t) (0xFFFFFFFF - 1000 + 3000));
+  fake::advance(3000);
+  module.loop();
+  CHECK(fan.state == HIGH);
+  CHECK(light.state == LOW);
+  CHECK((uint32_t) module.getNextTimerDeadline() == (uint32_t) (0xFFFFFFFF - 1000 + 20000));
+  fake::advance(17000);
+  module.loop();
+  CHECK(light.state == HIGH);
+}
+
+TEST(pendingSettingsSaveAcrossMillisRollover) {
+  ESPDomotic module;
+  Channel light("A", "light", 5, OUTPUT, HIGH);
+  module.addChannel(&light);
+  startModule(module);
+  module.setSettingsCommitDelay(3000);
+  fake::now = 0xFFFFFFFF - 1000;
+  LittleFS.remove("/settings.json");
+  module.scheduleChannelsSettingsSave();
+  fake::advance(2999);
+  module.loop();
+  CHECK(!LittleFS.exists("/settings.json"));
+  fake::advance(1);
+  module.loop();
+  CHECK(LittleFS.exists("/settings.json"));
+}